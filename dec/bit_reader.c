@@ -35,6 +35,14 @@ void BrotliInitBitReader(BrotliBitReader* const br, BrotliInput input) {
   br->next_in = br->buf_;
 }
 
+void BrotliInitBitReaderWithBuffer(BrotliBitReader* const br,
+                                   BrotliInput input,
+                                   const uint8_t* data, uint32_t size) {
+  BrotliInitBitReader(br, input);
+  br->next_in = data;
+  br->avail_in = size;
+}
+
 int BrotliWarmupBitReader(BrotliBitReader* const br) {
   if (br->bit_pos_ == (sizeof(br->val_) << 3)) {
     if (!br->avail_in) {
@@ -45,7 +45,7 @@ typedef struct {
   uint32_t    val_;          /* pre-fetched bits */
 #endif
   uint32_t    bit_pos_;      /* current bit-reading position in val_ */
-  uint8_t*    next_in;       /* the byte we're reading from */
+  const uint8_t* next_in;    /* the byte we're reading from */
   uint32_t    avail_in;
   int         eos_;          /* input stream is finished */
   BrotliInput input_;        /* input callback */
@@ -58,6 +58,14 @@ typedef struct {
 /* Initializes the bitreader fields. */
 void BrotliInitBitReader(BrotliBitReader* const br, BrotliInput input);
 
+/* Initializes the bitreader fields, so that it reads the first size bytes of
+   the input directly from data, and the rest through the input callback.
+   At least 8 readable bytes must follow these size bytes in memory, since the
+   bit window is filled with unaligned word loads. */
+void BrotliInitBitReaderWithBuffer(BrotliBitReader* const br,
+                                   BrotliInput input,
+                                   const uint8_t* data, uint32_t size);
+
 /* Ensures that accumulator is not empty. May consume one byte of input.
    Returns 0 if data is required but there is no input available. */
 int BrotliWarmupBitReader(BrotliBitReader* const br);
@@ -87,7 +95,7 @@ static BROTLI_INLINE int BrotliReadInput(
       }
       br->next_in = br->buf_;
     }
-    bytes_read = BrotliRead(br->input_, br->next_in + br->avail_in,
+    bytes_read = BrotliRead(br->input_, br->buf_ + br->avail_in,
         (size_t)(BROTLI_READ_SIZE - br->avail_in));
     if (bytes_read < 0) {
       return 0;
@@ -99,7 +107,7 @@ static BROTLI_INLINE int BrotliReadInput(
       }
       br->eos_ = 1;
       /* Store BROTLI_IMPLICIT_ZEROES bytes of zero after the stream end. */
-      memset(br->next_in + br->avail_in, 0, BROTLI_IMPLICIT_ZEROES);
+      memset(br->buf_ + br->avail_in, 0, BROTLI_IMPLICIT_ZEROES);
       br->avail_in += BROTLI_IMPLICIT_ZEROES;
     }
     return 1;
@@ -24,6 +24,7 @@
 #include "./transform.h"
 #include "./huffman.h"
 #include "./prefix.h"
+#include "./seek_index.h"
 
 #ifdef __ARM_NEON__
 #include <arm_neon.h>
@@ -53,6 +54,37 @@ static const int kNumInsertAndCopyCodes = 704;
 static const int kNumBlockLengthCodes = 26;
 static const int kLiteralContextBits = 6;
 static const int kDistanceContextBits = 2;
+/* At most this much of the input of BrotliDecompressBuffer is read directly
+   from the buffer, and the rest through the input callback. The bit reader
+   counts the direct bytes in a uint32_t, and the decoder converts byte counts
+   of it to int, so the cap is a power of two well below both limits. Inputs
+   of more than 1 GiB only copy the bytes after it. */
+static const size_t kMaxDirectInputSize = (size_t)1 << 30;
+/* Output buffers of BrotliDecompressBuffer in this size range are used as the
+   ring buffer. Their last kOutputRingBufferSlack bytes are only written by
+   bounds-checked code, which covers the 32 bytes of the fast backward copy
+   and the longest transformed dictionary word. */
+static const size_t kMinOutputRingBufferSize = 256;
+static const size_t kMaxOutputRingBufferSize = (size_t)1 << 30;
+static const int kOutputRingBufferSlack = 64;
+/* Ring buffer mask of such an output buffer, which leaves every position in it
+   as it is. The positions never wrap around, since decoding stops at the end
+   of the buffer, and back-references never reach before its start, since
+   there is no custom dictionary and larger distances refer to the static
+   dictionary. So they are all non-negative ints below 1 << 31. */
+static const int kOutputRingBufferMask = 0x7fffffff;
+/* BrotliDecompressRange feeds the input to the decoder in chunks of this
+   size, so that it writes out what it has decoded after each of them and can
+   stop soon after the end of the range. Past the seek point after the range,
+   the chunks are smaller, since at most a few bytes are missing there. */
+static const size_t kRangeInputChunkSize = 1 << 16;
+static const size_t kRangeTailChunkSize = 1 << 12;
+/* Initial ring buffer size of a stream that starts at a seek point. */
+static const int kSeekRingBufferSize = 1 << 16;
+/* A meta-block has at most this much output, and every meta-block with
+   output takes more than kMinMetaBlockBytes of the stream. */
+static const uint64_t kMaxMetaBlockSize = 1 << 24;
+static const uint64_t kMinMetaBlockBytes = 3;
 
 #define HUFFMAN_TABLE_BITS      8
 #define HUFFMAN_TABLE_MASK      0xff
@@ -642,7 +674,7 @@ static BrotliResult DecodeContextMap(int context_map_size,
       s->context_index = 0;
       BROTLI_LOG_UINT(context_map_size);
       BROTLI_LOG_UINT(*num_htrees);
-      *context_map_arg = (uint8_t*)malloc((size_t)context_map_size);
+      *context_map_arg = (uint8_t*)BROTLI_ALLOC(s, (size_t)context_map_size);
       if (*context_map_arg == 0) {
         return BROTLI_FAILURE();
       }
@@ -745,6 +777,10 @@ static void DecodeBlockTypeWithContext(BrotliState* s,
   s->context_map_slice = s->context_map + context_offset;
   s->literal_htree_index = s->context_map_slice[0];
   s->literal_htree = s->literal_hgroup.htrees[s->literal_htree_index];
+  if (s->literal_pair_tables) {
+    s->literal_pair_table = s->literal_pair_tables +
+        s->literal_htree_index * BROTLI_HUFFMAN_PAIR_TABLE_SIZE;
+  }
   context_mode = s->context_modes[s->block_type_rb[1]];
   s->context_lookup1 = &kContextLookup[kContextLookupOffsets[context_mode]];
   s->context_lookup2 = &kContextLookup[kContextLookupOffsets[context_mode + 1]];
@@ -772,33 +808,67 @@ BrotliResult WriteRingBuffer(BrotliOutput output,
   return BROTLI_RESULT_SUCCESS;
 }
 
+/* Writes the bytes decoded since the last write to the output while the
+   decoder waits for more input, instead of keeping them in the ring buffer
+   until it wraps around. Returns BROTLI_RESULT_NEEDS_MORE_INPUT, or
+   BROTLI_RESULT_NEEDS_MORE_OUTPUT if the output did not take all of them;
+   the rest is written by the next call. */
+static BrotliResult FlushRingBuffer(BrotliOutput output, int pos,
+                                    BrotliState* s) {
+  BrotliResult result;
+  /* pos may be past the end while the wrap-around is pending. */
+  if (pos > s->ringbuffer_size) {
+    pos = s->ringbuffer_size;
+  }
+  if (pos <= s->partially_written) {
+    return BROTLI_RESULT_NEEDS_MORE_INPUT;
+  }
+  s->to_write = pos;
+  result = WriteRingBuffer(output, s);
+  if (result != BROTLI_RESULT_SUCCESS) {
+    return result;
+  }
+  return BROTLI_RESULT_NEEDS_MORE_INPUT;
+}
+
 BrotliResult BROTLI_NOINLINE CopyUncompressedBlockToOutput(BrotliOutput output,
-                                                           int pos,
+                                                           int* pos,
                                                            BrotliState* s) {
   BrotliResult result;
   int num_read;
+  size_t nbytes;
   /* State machine */
   for (;;) {
     switch ((int)s->substate_uncompressed) {
       case BROTLI_STATE_UNCOMPRESSED_NONE:
         /* For short lengths copy byte-by-byte */
-        if (s->meta_block_remaining_len < 8 ||
-            s->meta_block_remaining_len < BrotliGetRemainingBytes(&s->br)) {
+        if (s->meta_block_remaining_len < 8) {
           s->substate_uncompressed = BROTLI_STATE_UNCOMPRESSED_SHORT;
           break;
         }
-        /* Copy remaining bytes from s->br.buf_ to ringbuffer. */
-        s->nbytes = (int)BrotliGetRemainingBytes(&s->br);
-        BrotliCopyBytes(&s->ringbuffer[pos], &s->br, (size_t)s->nbytes);
-        pos += s->nbytes;
+        /* Copy the bytes buffered in the bit reader to the ringbuffer, up to
+           the end of the block or of the ringbuffer. The bit reader can hold
+           the whole input if it reads it directly from memory. */
+        nbytes = BrotliGetRemainingBytes(&s->br);
+        if (nbytes > (size_t)s->meta_block_remaining_len) {
+          nbytes = (size_t)s->meta_block_remaining_len;
+        }
+        if (nbytes > (size_t)(s->ringbuffer_size - *pos)) {
+          nbytes = (size_t)(s->ringbuffer_size - *pos);
+        }
+        s->nbytes = (int)nbytes;
+        BrotliCopyBytes(&s->ringbuffer[*pos], &s->br, nbytes);
+        *pos += s->nbytes;
         s->meta_block_remaining_len -= s->nbytes;
-        if (pos >= s->ringbuffer_size) {
+        if (*pos >= s->ringbuffer_size) {
           s->to_write = s->ringbuffer_size;
-          s->partially_written = 0;
           s->substate_uncompressed = BROTLI_STATE_UNCOMPRESSED_WRITE_1;
           break;
         }
-        if (pos + s->meta_block_remaining_len >= s->ringbuffer_size) {
+        if (s->meta_block_remaining_len == 0) {
+          return BROTLI_RESULT_SUCCESS;
+        }
+        if (*pos + s->meta_block_remaining_len >= s->ringbuffer_size) {
           s->substate_uncompressed = BROTLI_STATE_UNCOMPRESSED_FILL;
         } else {
           s->substate_uncompressed = BROTLI_STATE_UNCOMPRESSED_COPY;
@@ -812,12 +882,11 @@ BrotliResult BROTLI_NOINLINE CopyUncompressedBlockToOutput(BrotliOutput output,
           if (!BrotliCheckInputAmount(&s->br, 8)) {
             return BROTLI_RESULT_NEEDS_MORE_INPUT;
           }
-          s->ringbuffer[pos++] = (uint8_t)BrotliReadBits(&s->br, 8);
+          s->ringbuffer[(*pos)++] = (uint8_t)BrotliReadBits(&s->br, 8);
           s->meta_block_remaining_len--;
         }
-        if (pos >= s->ringbuffer_size) {
+        if (*pos >= s->ringbuffer_size) {
           s->to_write = s->ringbuffer_size;
-          s->partially_written = 0;
           s->substate_uncompressed = BROTLI_STATE_UNCOMPRESSED_WRITE_2;
         } else {
           s->substate_uncompressed = BROTLI_STATE_UNCOMPRESSED_NONE;
@@ -826,17 +895,33 @@ BrotliResult BROTLI_NOINLINE CopyUncompressedBlockToOutput(BrotliOutput output,
         /* No break, if state is updated, continue to next state */
       case BROTLI_STATE_UNCOMPRESSED_WRITE_1:
       case BROTLI_STATE_UNCOMPRESSED_WRITE_2:
+        if (s->ringbuffer_is_output) {
+          /* The output buffer is full, so the block has to end here. */
+          if (s->meta_block_remaining_len != 0) {
+            return BROTLI_FAILURE();
+          }
+          s->substate_uncompressed = BROTLI_STATE_UNCOMPRESSED_NONE;
+          return BROTLI_RESULT_SUCCESS;
+        }
         result = WriteRingBuffer(output, s);
         if (result != BROTLI_RESULT_SUCCESS) {
           return result;
         }
-        pos &= s->ringbuffer_mask;
+        s->partially_written = 0;
+        *pos &= s->ringbuffer_mask;
         s->max_distance = s->max_backward_distance;
+        s->custom_dict_is_missing = 0;
         /* If we wrote past the logical end of the ringbuffer, copy the tail
            of the ringbuffer to its beginning and flush the ringbuffer to the
            output. */
-        memcpy(s->ringbuffer, s->ringbuffer_end, (size_t)pos);
-        if (pos + s->meta_block_remaining_len >= s->ringbuffer_size) {
+        memcpy(s->ringbuffer, s->ringbuffer_end, (size_t)(*pos));
+        if (s->meta_block_remaining_len > 0 &&
+            BrotliGetRemainingBytes(&s->br) != 0) {
+          /* Continue with the input buffered in the bit reader. */
+          s->substate_uncompressed = BROTLI_STATE_UNCOMPRESSED_NONE;
+          break;
+        }
+        if (*pos + s->meta_block_remaining_len >= s->ringbuffer_size) {
           s->substate_uncompressed = BROTLI_STATE_UNCOMPRESSED_FILL;
         } else {
           s->substate_uncompressed = BROTLI_STATE_UNCOMPRESSED_COPY;
@@ -847,25 +932,24 @@ BrotliResult BROTLI_NOINLINE CopyUncompressedBlockToOutput(BrotliOutput output,
         /* If we have more to copy than the remaining size of the ringbuffer,
            then we first fill the ringbuffer from the input and then flush the
            ringbuffer to the output */
-        s->nbytes = s->ringbuffer_size - pos;
-        num_read = BrotliRead(s->br.input_, &s->ringbuffer[pos],
+        s->nbytes = s->ringbuffer_size - *pos;
+        num_read = BrotliRead(s->br.input_, &s->ringbuffer[*pos],
                               (size_t)s->nbytes);
-        pos += num_read;
+        *pos += num_read;
         s->meta_block_remaining_len -= num_read;
         if (num_read < s->nbytes) {
           if (num_read < 0) return BROTLI_FAILURE();
           return BROTLI_RESULT_NEEDS_MORE_INPUT;
         }
         s->to_write = s->ringbuffer_size;
-        s->partially_written = 0;
         s->substate_uncompressed = BROTLI_STATE_UNCOMPRESSED_WRITE_1;
         break;
       case BROTLI_STATE_UNCOMPRESSED_COPY:
         /* Copy straight from the input onto the ringbuffer. The ringbuffer will
            be flushed to the output at a later time. */
-        num_read = BrotliRead(s->br.input_, &s->ringbuffer[pos],
+        num_read = BrotliRead(s->br.input_, &s->ringbuffer[*pos],
                               (size_t)s->meta_block_remaining_len);
-        pos += num_read;
+        *pos += num_read;
         s->meta_block_remaining_len -= num_read;
         if (s->meta_block_remaining_len > 0) {
           if (num_read < 0) return BROTLI_FAILURE();
@@ -878,6 +962,112 @@ BrotliResult BROTLI_NOINLINE CopyUncompressedBlockToOutput(BrotliOutput output,
   return BROTLI_FAILURE();
 }
 
+static uint64_t ReadLittleEndian(const uint8_t* p, int n) {
+  uint64_t value = 0;
+  while (n-- > 0) {
+    value = (value << 8) | p[n];
+  }
+  return value;
+}
+
+/* Returns 1 if the bytes before payload end with the header of a metadata
+   meta-block of size bytes, as the encoder writes it: ISLAST = 0,
+   MNIBBLES = 0, the reserved bit, the shortest MSKIPBYTES, MSKIPLEN - 1 and
+   zero bits up to the byte boundary. The header starts at a bit of an
+   earlier byte that depends on the meta-block before it, so every bit is
+   tried. Returns 0 otherwise. */
+static int IsAfterMetadataHeader(const uint8_t* encoded_buffer,
+                                 const uint8_t* payload, size_t size) {
+  uint64_t header;
+  int nbytes = 1;
+  int start_bit;
+  if (size == 0 || size > kMaxMetaBlockSize) {
+    return 0;
+  }
+  while (nbytes < 3 && ((size - 1) >> (8 * nbytes)) != 0) {
+    ++nbytes;
+  }
+  /* MNIBBLES = 0 is coded as 3 in the two bits after ISLAST. */
+  header = (3 << 1) | ((uint64_t)nbytes << 4) | ((uint64_t)(size - 1) << 6);
+  for (start_bit = 0; start_bit < 8; ++start_bit) {
+    int header_bytes = (start_bit + 6 + 8 * nbytes + 7) >> 3;
+    uint64_t mask = ((uint64_t)1 << (8 * header_bytes - start_bit)) - 1;
+    if (payload - encoded_buffer >= header_bytes &&
+        ((ReadLittleEndian(payload - header_bytes, header_bytes) >>
+          start_bit) & mask) == header) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Returns the start of the seek points in the seek index of the stream and
+   sets *num_points to their number and *total_size to the size of the
+   decompressed data, or returns NULL if the stream has no valid seek
+   index. */
+static const uint8_t* FindSeekIndex(size_t encoded_size,
+                                    const uint8_t* encoded_buffer,
+                                    size_t* num_points, size_t* total_size) {
+  const uint8_t* trailer;
+  const uint8_t* points;
+  size_t n;
+  if (encoded_size < kSeekIndexTrailerSize + 1 ||
+      encoded_buffer[encoded_size - 1] != 3) {
+    return NULL;
+  }
+  trailer = encoded_buffer + encoded_size - 1 - kSeekIndexTrailerSize;
+  if (memcmp(trailer + 12, kSeekIndexMagic, 4) != 0) {
+    return NULL;
+  }
+  n = (size_t)ReadLittleEndian(trailer + 8, 4);
+  if (n > (size_t)(trailer - encoded_buffer) / kSeekPointSize) {
+    return NULL;
+  }
+  /* The magic bytes could also be the end of the data in the last
+     meta-block, so the index has to be the whole payload of a metadata
+     meta-block. */
+  points = trailer - n * kSeekPointSize;
+  if (!IsAfterMetadataHeader(encoded_buffer, points,
+                             n * kSeekPointSize + kSeekIndexTrailerSize)) {
+    return NULL;
+  }
+  *num_points = n;
+  *total_size = (size_t)ReadLittleEndian(trailer, 8);
+  return points;
+}
+
+/* Returns 1 if the seek points are in increasing order in both the output and
+   the stream, and the decompressed size in the trailer of the index is not
+   smaller than the offset of the last seek point, nor larger than what the
+   stream after it can hold. Returns 0 otherwise. */
+static int IsValidSeekIndex(const uint8_t* encoded_buffer,
+                            const uint8_t* points, size_t num_points,
+                            size_t total_size) {
+  uint64_t position = 0;
+  uint64_t encoded_offset = 0;
+  uint64_t encoded_end = (uint64_t)(points - encoded_buffer);
+  uint64_t num_meta_blocks;
+  size_t i;
+  for (i = 0; i < num_points; ++i) {
+    uint64_t next_position = ReadLittleEndian(points + i * kSeekPointSize, 8);
+    uint64_t next_encoded_offset =
+        ReadLittleEndian(points + i * kSeekPointSize + 8, 8);
+    if (next_position <= position || next_encoded_offset <= encoded_offset ||
+        next_encoded_offset >= encoded_end) {
+      return 0;
+    }
+    position = next_position;
+    encoded_offset = next_encoded_offset;
+  }
+  if (total_size < position) {
+    return 0;
+  }
+  num_meta_blocks = (total_size - position) / kMaxMetaBlockSize +
+      ((total_size - position) % kMaxMetaBlockSize != 0);
+  return num_meta_blocks <=
+      (encoded_end - encoded_offset) / kMinMetaBlockBytes;
+}
+
 int BrotliDecompressedSize(size_t encoded_size,
                            const uint8_t* encoded_buffer,
                            size_t* decoded_size) {
@@ -887,6 +1077,13 @@ int BrotliDecompressedSize(size_t encoded_size,
   BrotliState s;
   int next_block_header;
   int offset;
+  size_t num_points;
+  const uint8_t* points = FindSeekIndex(encoded_size, encoded_buffer,
+                                        &num_points, decoded_size);
+  if (points != NULL &&
+      IsValidSeekIndex(encoded_buffer, points, num_points, *decoded_size)) {
+    return 1;
+  }
   BrotliStateInit(&s);
   BrotliInitBitReader(&br, in);
   if (!BrotliReadInput(&br, 1) || !BrotliWarmupBitReader(&br)) {
@@ -913,10 +1110,14 @@ int BrotliDecompressedSize(size_t encoded_size,
   return (offset < encoded_size) && ((encoded_buffer[offset] & 3) == 3);
 }
 
+static const int kRingBufferWriteAheadSlack = BROTLI_READ_SIZE;
+
 /* Allocates the smallest feasible ring buffer.
 
    If we know the data size is small, do not allocate more ringbuffer
-   size than needed to reduce memory usage.
+   size than needed to reduce memory usage. If the first meta-block is not
+   the last one, the ring buffer only has to hold it without wrapping around,
+   and is grown by BrotliGrowRingBuffer when the next meta-blocks need more.
 
    This method is called before the first non-empty non-metadata block is
    processed. When this method is called, metablock size and flags MUST be
@@ -924,7 +1125,6 @@ int BrotliDecompressedSize(size_t encoded_size,
 */
 int BROTLI_NOINLINE BrotliAllocateRingBuffer(BrotliState* s,
     BrotliBitReader* br) {
-  static const int kRingBufferWriteAheadSlack = BROTLI_READ_SIZE;
   int is_last = s->is_last_metablock;
   s->ringbuffer_size = 1 << s->window_bits;
 
@@ -944,6 +1144,13 @@ int BROTLI_NOINLINE BrotliAllocateRingBuffer(BrotliState* s,
         && s->ringbuffer_size > 32) {
       s->ringbuffer_size >>= 1;
     }
+  } else if (!s->custom_dict) {
+    /* Leave room for at least one more byte, so that pos does not reach the
+       end of the ring buffer before it is grown for the next meta-block. */
+    while (s->ringbuffer_size > s->meta_block_remaining_len * 2
+        && s->ringbuffer_size > 32) {
+      s->ringbuffer_size >>= 1;
+    }
   }
 
   /* But make it fit the custom dictionary if there is one. */
@@ -952,11 +1159,23 @@ int BROTLI_NOINLINE BrotliAllocateRingBuffer(BrotliState* s,
   }
 
   s->ringbuffer_mask = s->ringbuffer_size - 1;
-  s->ringbuffer = (uint8_t*)malloc((size_t)(s->ringbuffer_size +
-                                         kRingBufferWriteAheadSlack +
-                                         kBrotliMaxDictionaryWordLength));
+  if (s->spare_ringbuffer != 0) {
+    /* Reuse the ring buffer of the previous stream if it is large enough. */
+    if (s->ringbuffer_capacity >= s->ringbuffer_size) {
+      s->ringbuffer = s->spare_ringbuffer;
+      s->spare_ringbuffer = NULL;
+    } else {
+      BROTLI_FREE(s, s->spare_ringbuffer);
+    }
+  }
   if (!s->ringbuffer) {
-    return 0;
+    s->ringbuffer = (uint8_t*)BROTLI_ALLOC(s, (size_t)(s->ringbuffer_size +
+                                              kRingBufferWriteAheadSlack +
+                                              kBrotliMaxDictionaryWordLength));
+    if (!s->ringbuffer) {
+      return 0;
+    }
+    s->ringbuffer_capacity = s->ringbuffer_size;
   }
   s->ringbuffer_end = s->ringbuffer + s->ringbuffer_size;
   s->ringbuffer[s->ringbuffer_size - 2] = 0;
@@ -969,17 +1188,324 @@ int BROTLI_NOINLINE BrotliAllocateRingBuffer(BrotliState* s,
   return 1;
 }
 
-BrotliResult BrotliDecompressBuffer(size_t encoded_size,
-                                    const uint8_t* encoded_buffer,
-                                    size_t* decoded_size,
-                                    uint8_t* decoded_buffer) {
+/* Grows the ring buffer so that the current meta-block fits into it after
+   pos, or to the full window size if it does not fit at all. Since a ring
+   buffer smaller than the window never wraps around, its contents are the
+   first pos bytes of the output and are simply moved over. The memory of
+   the old ring buffer is reused if it is large enough.
+
+   This method is called before a meta-block is decoded, if the ring buffer
+   is smaller than the window and would otherwise wrap around in it. */
+static int BROTLI_NOINLINE BrotliGrowRingBuffer(BrotliState* s, int pos) {
+  const int window_size = 1 << s->window_bits;
+  int new_size = s->ringbuffer_size;
+  uint8_t last_bytes[2];
+  last_bytes[0] = s->ringbuffer[s->ringbuffer_size - 2];
+  last_bytes[1] = s->ringbuffer[s->ringbuffer_size - 1];
+  while (new_size <= pos + s->meta_block_remaining_len &&
+         new_size < window_size) {
+    new_size <<= 1;
+  }
+  if (new_size > s->ringbuffer_capacity) {
+    uint8_t* new_ringbuffer = (uint8_t*)BROTLI_ALLOC(s, (size_t)(new_size +
+        kRingBufferWriteAheadSlack + kBrotliMaxDictionaryWordLength));
+    if (!new_ringbuffer) {
+      return 0;
+    }
+    memcpy(new_ringbuffer, s->ringbuffer, (size_t)pos);
+    BROTLI_FREE(s, s->ringbuffer);
+    s->ringbuffer = new_ringbuffer;
+    s->ringbuffer_capacity = new_size;
+  }
+  s->ringbuffer_size = new_size;
+  s->ringbuffer_mask = new_size - 1;
+  s->ringbuffer_end = s->ringbuffer + new_size;
+  /* The context of the first two bytes wraps around to the end. */
+  if (pos < 2) {
+    s->ringbuffer[new_size - 2] = last_bytes[0];
+    s->ringbuffer[new_size - 1] = last_bytes[1];
+  }
+  return 1;
+}
+
+static BrotliResult DecompressBuffer(size_t encoded_size,
+                                     const uint8_t* encoded_buffer,
+                                     size_t* decoded_size,
+                                     uint8_t* decoded_buffer,
+                                     int output_is_ringbuffer) {
   BrotliMemInput memin;
   BrotliInput in = BrotliInitMemInput(encoded_buffer, encoded_size, &memin);
   BrotliMemOutput mout;
   BrotliOutput out = BrotliInitMemOutput(decoded_buffer, *decoded_size, &mout);
-  BrotliResult success = BrotliDecompress(in, out);
+  BrotliState s;
+  BrotliResult result;
+  BrotliStateInit(&s);
+  if (encoded_size > 2 * BROTLI_READ_SIZE) {
+    /* The bit reader takes all but the last BROTLI_READ_SIZE bytes of the
+       input directly from the buffer, so it does not have to copy them, and
+       the input checks of the decoding loops only fail near the end. The
+       rest goes through the input callback, which pads the end of the
+       stream. */
+    size_t direct_size = encoded_size - BROTLI_READ_SIZE;
+    if (direct_size > kMaxDirectInputSize) {
+      direct_size = kMaxDirectInputSize;
+    }
+    BrotliStateSetInputBuffer(&s, in, encoded_buffer, (uint32_t)direct_size);
+    memin.pos = direct_size;
+  }
+  if (output_is_ringbuffer) {
+    /* Decode straight into the output buffer. */
+    s.ringbuffer = decoded_buffer;
+    s.ringbuffer_size = (int)*decoded_size;
+    s.ringbuffer_mask = kOutputRingBufferMask;
+    s.ringbuffer_end = decoded_buffer + *decoded_size - kOutputRingBufferSlack;
+    s.ringbuffer_is_output = 1;
+  }
+  result = BrotliDecompressStreaming(in, out, 1, &s);
+  if (result == BROTLI_RESULT_NEEDS_MORE_INPUT) {
+    /* Not ok: it didn't finish even though this is a non-streaming function. */
+    result = BROTLI_FAILURE();
+  }
   *decoded_size = mout.pos;
-  return success;
+  if (output_is_ringbuffer) {
+    if (result == BROTLI_RESULT_NEEDS_MORE_OUTPUT) {
+      /* Decoding stopped at the first meta-block that does not fit, so the
+         ones before it are in the output buffer. */
+      *decoded_size = (size_t)s.pos;
+    }
+    s.ringbuffer = NULL;
+  }
+  BrotliStateCleanup(&s);
+  return result;
+}
+
+BrotliResult BrotliDecompressBuffer(size_t encoded_size,
+                                    const uint8_t* encoded_buffer,
+                                    size_t* decoded_size,
+                                    uint8_t* decoded_buffer) {
+  int output_is_ringbuffer = *decoded_size >= kMinOutputRingBufferSize &&
+      *decoded_size <= kMaxOutputRingBufferSize;
+  return DecompressBuffer(encoded_size, encoded_buffer, decoded_size,
+                          decoded_buffer, output_is_ringbuffer);
+}
+
+size_t BrotliGetSeekPoints(size_t encoded_size,
+                           const uint8_t* encoded_buffer,
+                           size_t max_points,
+                           size_t* positions) {
+  size_t num_points = 0;
+  size_t total_size;
+  const uint8_t* points = FindSeekIndex(encoded_size, encoded_buffer,
+                                        &num_points, &total_size);
+  size_t i;
+  if (points == NULL) {
+    return 0;
+  }
+  for (i = 0; i < num_points && i < max_points; ++i) {
+    positions[i] = (size_t)ReadLittleEndian(points + i * kSeekPointSize, 8);
+  }
+  return num_points;
+}
+
+/* Returns the number of seek points at or before offset in the output. The
+   seek points are sorted by both offsets. */
+static size_t CountSeekPointsUpTo(const uint8_t* points, size_t num_points,
+                                  size_t offset) {
+  size_t lo = 0;
+  size_t hi = num_points;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (ReadLittleEndian(points + mid * kSeekPointSize, 8) <= offset) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/* Returns the offset in the stream of the first seek point at or after end
+   in the output, or encoded_size if there is none. All the output before end
+   is decoded from the stream before that offset. */
+static size_t FindSeekEnd(size_t encoded_size, const uint8_t* encoded_buffer,
+                          size_t end) {
+  size_t num_points = 0;
+  size_t total_size;
+  const uint8_t* points = FindSeekIndex(encoded_size, encoded_buffer,
+                                        &num_points, &total_size);
+  size_t i;
+  size_t encoded_end;
+  if (points == NULL || end == 0) {
+    return encoded_size;
+  }
+  i = CountSeekPointsUpTo(points, num_points, end - 1);
+  if (i == num_points) {
+    return encoded_size;
+  }
+  encoded_end = (size_t)ReadLittleEndian(points + i * kSeekPointSize + 8, 8);
+  return encoded_end < encoded_size ? encoded_end : encoded_size;
+}
+
+/* Finds the last seek point at or before offset in the seek index of the
+   stream. Returns 0 if the stream has no valid seek index or offset is
+   before its first seek point. */
+static int FindSeekPoint(size_t encoded_size, const uint8_t* encoded_buffer,
+                         size_t offset, size_t* position,
+                         size_t* encoded_offset, uint8_t* prev_bytes) {
+  size_t num_points = 0;
+  size_t total_size;
+  const uint8_t* points = FindSeekIndex(encoded_size, encoded_buffer,
+                                        &num_points, &total_size);
+  size_t i;
+  size_t start;
+  if (points == NULL) {
+    return 0;
+  }
+  i = CountSeekPointsUpTo(points, num_points, offset);
+  if (i == 0) {
+    return 0;
+  }
+  --i;
+  start = (size_t)ReadLittleEndian(points + i * kSeekPointSize + 8, 8);
+  if (start >= (size_t)(points - encoded_buffer)) {
+    return 0;
+  }
+  *position = (size_t)ReadLittleEndian(points + i * kSeekPointSize, 8);
+  *encoded_offset = start;
+  prev_bytes[0] = points[i * kSeekPointSize + 16];
+  prev_bytes[1] = points[i * kSeekPointSize + 17];
+  return 1;
+}
+
+/* Prepares a new state to decode a stream that starts at a seek point, which
+   is position bytes into the output and follows the last two output bytes
+   in prev_bytes. The meta-blocks from there on do not reach before the seek
+   point, so the ring buffer starts small and empty at the seek point, and
+   grows like that of a new stream. Dictionary words are addressed after the
+   largest distance at that position though, so the output before counts as
+   a custom dictionary for the distances, but copies from it are invalid.
+   The first literals are predicted from prev_bytes at the end of the ring
+   buffer. */
+static int StartAtSeekPoint(BrotliState* s, uint32_t window_bits,
+                            size_t position, const uint8_t* prev_bytes) {
+  const int window_size = 1 << window_bits;
+  s->ringbuffer_size = window_size < kSeekRingBufferSize ?
+      window_size : kSeekRingBufferSize;
+  s->ringbuffer_mask = s->ringbuffer_size - 1;
+  s->ringbuffer = (uint8_t*)BROTLI_ALLOC(s, (size_t)(s->ringbuffer_size +
+                                            kRingBufferWriteAheadSlack +
+                                            kBrotliMaxDictionaryWordLength));
+  if (!s->ringbuffer) {
+    return 0;
+  }
+  s->ringbuffer_capacity = s->ringbuffer_size;
+  s->ringbuffer_end = s->ringbuffer + s->ringbuffer_size;
+  s->window_bits = window_bits;
+  s->custom_dict_size =
+      position < (size_t)window_size ? (int)position : window_size;
+  s->custom_dict_is_missing = 1;
+  s->pos = 0;
+  s->ringbuffer[s->ringbuffer_size - 2] = prev_bytes[0];
+  s->ringbuffer[s->ringbuffer_size - 1] = prev_bytes[1];
+  s->state = BROTLI_STATE_BITREADER_WARMUP;
+  return 1;
+}
+
+/* Output callback of BrotliDecompressRange, which keeps the bytes in
+   [skip, skip + length) of its output, and refuses any more after them. */
+typedef struct {
+  uint8_t* buffer;
+  size_t skip;
+  size_t length;
+  size_t pos;
+} BrotliRangeOutput;
+
+static int RangeOutputFunction(void* data, const uint8_t* buf, size_t count) {
+  BrotliRangeOutput* output = (BrotliRangeOutput*)data;
+  size_t skipped = count < output->skip ? count : output->skip;
+  size_t n = count - skipped;
+  output->skip -= skipped;
+  if (n > output->length - output->pos) {
+    n = output->length - output->pos;
+  }
+  memcpy(output->buffer + output->pos, buf + skipped, n);
+  output->pos += n;
+  return (int)(skipped + n);
+}
+
+BrotliResult BrotliDecompressRange(size_t encoded_size,
+                                   const uint8_t* encoded_buffer,
+                                   size_t offset,
+                                   size_t* decoded_size,
+                                   uint8_t* decoded_buffer,
+                                   int* is_end) {
+  BrotliState s;
+  BrotliResult result;
+  BrotliRangeOutput range;
+  BrotliOutput out;
+  size_t position = 0;
+  size_t encoded_offset = 0;
+  size_t encoded_end;
+  uint8_t prev_bytes[2];
+  int finish;
+  BrotliStateInit(&s);
+  if (FindSeekPoint(encoded_size, encoded_buffer, offset, &position,
+                    &encoded_offset, prev_bytes)) {
+    BrotliMemInput memin;
+    BrotliInput in = BrotliInitMemInput(NULL, 0, &memin);
+    uint32_t window_bits;
+    /* The window size is still taken from the stream header. */
+    BrotliInitBitReaderWithBuffer(&s.br, in, encoded_buffer, 1);
+    BrotliWarmupBitReader(&s.br);
+    window_bits = DecodeWindowBits(&s.br);
+    BrotliInitBitReader(&s.br, in);
+    if (window_bits == 9 ||
+        !StartAtSeekPoint(&s, window_bits, position, prev_bytes)) {
+      BrotliStateCleanup(&s);
+      return BROTLI_FAILURE();
+    }
+  }
+  range.buffer = decoded_buffer;
+  range.skip = offset - position;
+  range.length = *decoded_size;
+  range.pos = 0;
+  out.cb_ = &RangeOutputFunction;
+  out.data_ = &range;
+  /* The decoder writes out what it has decoded when the input runs out, so
+     the input is cut at the seek point after the range, if there is one. */
+  encoded_end = offset + *decoded_size < offset ? encoded_size :
+      FindSeekEnd(encoded_size, encoded_buffer, offset + *decoded_size);
+  do {
+    size_t chunk_size = encoded_size - encoded_offset;
+    BrotliMemInput memin;
+    BrotliInput in;
+    if (encoded_offset < encoded_end &&
+        chunk_size > encoded_end - encoded_offset) {
+      chunk_size = encoded_end - encoded_offset;
+    }
+    if (chunk_size > kRangeInputChunkSize) {
+      chunk_size = kRangeInputChunkSize;
+    }
+    if (encoded_offset >= encoded_end && chunk_size > kRangeTailChunkSize) {
+      chunk_size = kRangeTailChunkSize;
+    }
+    in = BrotliInitMemInput(encoded_buffer + encoded_offset, chunk_size,
+                            &memin);
+    finish = encoded_offset + chunk_size == encoded_size;
+    result = BrotliDecompressStreaming(in, out, finish, &s);
+    encoded_offset += memin.pos;
+  } while (result == BROTLI_RESULT_NEEDS_MORE_INPUT && !finish);
+  BrotliStateCleanup(&s);
+  *decoded_size = range.pos;
+  /* The output callback refuses the data after the range. */
+  *is_end = result == BROTLI_RESULT_SUCCESS;
+  if (result == BROTLI_RESULT_NEEDS_MORE_OUTPUT) {
+    result = BROTLI_RESULT_SUCCESS;
+  } else if (result == BROTLI_RESULT_NEEDS_MORE_INPUT) {
+    /* The stream is cut off within the range. */
+    result = BROTLI_FAILURE();
+  }
+  return result;
 }
 
 BrotliResult BrotliDecompress(BrotliInput input, BrotliOutput output) {
@@ -1024,8 +1550,6 @@ BrotliResult BrotliDecompressStreaming(BrotliInput input, BrotliOutput output,
   int i = s->loop_counter;
   BrotliResult result = BROTLI_RESULT_SUCCESS;
   BrotliBitReader* br = &s->br;
-  int initial_remaining_len;
-  int bytes_copied;
   uint8_t *copy_src;
   uint8_t *copy_dst;
   /* We need the slack region for the following reasons:
@@ -1044,6 +1568,8 @@ BrotliResult BrotliDecompressStreaming(BrotliInput input, BrotliOutput output,
         if (finish) {
           BROTLI_LOG(("Unexpected end of input. State: %d\n", s->state));
           result = BROTLI_FAILURE();
+        } else if (s->ringbuffer != 0) {
+          result = FlushRingBuffer(output, pos, s);
         }
       }
       break;  /* Fail, or partial data. */
@@ -1061,8 +1587,11 @@ BrotliResult BrotliDecompressStreaming(BrotliInput input, BrotliOutput output,
           result = BROTLI_RESULT_NEEDS_MORE_INPUT;
           break;
         }
-        /* Decode window size. */
-        s->window_bits = DecodeWindowBits(br); /* Reads 1..7 bits. */
+        /* Decode window size, unless the decoding starts at a seek point,
+           where there is no stream header. */
+        if (s->window_bits == 0) {
+          s->window_bits = DecodeWindowBits(br); /* Reads 1..7 bits. */
+        }
         BROTLI_LOG_UINT(s->window_bits);
         if (s->window_bits == 9) {
           /* Value 9 is reserved for future use. */
@@ -1073,10 +1602,12 @@ BrotliResult BrotliDecompressStreaming(BrotliInput input, BrotliOutput output,
         s->max_backward_distance_minus_custom_dict_size =
             s->max_backward_distance - s->custom_dict_size;
 
-        /* Allocate memory for both block_type_trees and block_len_trees. */
-        s->block_type_trees = (HuffmanCode*)malloc(
-            6 * BROTLI_HUFFMAN_MAX_TABLE_SIZE * sizeof(HuffmanCode));
-
+        /* Allocate memory for both block_type_trees and block_len_trees,
+           unless it is kept from a previous stream. */
+        if (s->block_type_trees == NULL) {
+          s->block_type_trees = (HuffmanCode*)BROTLI_ALLOC(s,
+              6 * BROTLI_HUFFMAN_MAX_TABLE_SIZE * sizeof(HuffmanCode));
+        }
         if (s->block_type_trees == NULL) {
           result = BROTLI_FAILURE();
           break;
@@ -1111,6 +1642,12 @@ BrotliResult BrotliDecompressStreaming(BrotliInput input, BrotliOutput output,
           s->state = BROTLI_STATE_METADATA;
           break;
         }
+        if (s->ringbuffer_is_output &&
+            s->meta_block_remaining_len > s->ringbuffer_size - pos) {
+          /* The meta-block does not fit into the output buffer. */
+          result = BROTLI_RESULT_NEEDS_MORE_OUTPUT;
+          break;
+        }
         if (s->meta_block_remaining_len == 0) {
           s->state = BROTLI_STATE_METABLOCK_DONE;
           break;
@@ -1120,6 +1657,13 @@ BrotliResult BrotliDecompressStreaming(BrotliInput input, BrotliOutput output,
             result = BROTLI_FAILURE();
             break;
           }
+        } else if (pos + s->meta_block_remaining_len >= s->ringbuffer_size &&
+                   s->ringbuffer_size < (1 << s->window_bits) &&
+                   !s->ringbuffer_is_output) {
+          if (!BrotliGrowRingBuffer(s, pos)) {
+            result = BROTLI_FAILURE();
+            break;
+          }
         }
         if (s->is_uncompressed) {
           s->state = BROTLI_STATE_UNCOMPRESSED;
@@ -1129,14 +1673,14 @@ BrotliResult BrotliDecompressStreaming(BrotliInput input, BrotliOutput output,
         s->state = BROTLI_STATE_HUFFMAN_CODE_0;
         break;
       case BROTLI_STATE_UNCOMPRESSED:
-        initial_remaining_len = s->meta_block_remaining_len;
-        /* pos is given as argument since s->pos is only updated at the end. */
-        result = CopyUncompressedBlockToOutput(output, pos, s);
-        bytes_copied = initial_remaining_len - s->meta_block_remaining_len;
-        pos = (pos + bytes_copied) & s->ringbuffer_mask;
+        /* pos is passed since s->pos is only updated at the end. It stays
+           past the end of the ring buffer until the wrap-around is written,
+           CopyUncompressedBlockToOutput masks it then. */
+        result = CopyUncompressedBlockToOutput(output, &pos, s);
         if (result != BROTLI_RESULT_SUCCESS) {
           break;
         }
+        pos &= s->ringbuffer_mask;
         s->state = BROTLI_STATE_METABLOCK_DONE;
         break;
       case BROTLI_STATE_METADATA:
@@ -1213,7 +1757,8 @@ BrotliResult BrotliDecompressStreaming(BrotliInput input, BrotliOutput output,
         BROTLI_LOG_UINT(s->num_direct_distance_codes);
         BROTLI_LOG_UINT(s->distance_postfix_bits);
         s->distance_postfix_mask = (int)BitMask(s->distance_postfix_bits);
-        s->context_modes = (uint8_t*)malloc((size_t)s->num_block_types[0]);
+        s->context_modes =
+            (uint8_t*)BROTLI_ALLOC(s, (size_t)s->num_block_types[0]);
         if (s->context_modes == 0) {
           result = BROTLI_FAILURE();
           break;
@@ -1249,13 +1794,12 @@ BrotliResult BrotliDecompressStreaming(BrotliInput input, BrotliOutput output,
           if (result != BROTLI_RESULT_SUCCESS) {
             break;
           }
-          BrotliHuffmanTreeGroupInit(
-              &s->literal_hgroup, kNumLiteralCodes, s->num_literal_htrees);
-          BrotliHuffmanTreeGroupInit(
-              &s->insert_copy_hgroup, kNumInsertAndCopyCodes,
-              s->num_block_types[1]);
-          BrotliHuffmanTreeGroupInit(
-              &s->distance_hgroup, num_distance_codes, s->num_dist_htrees);
+          if (!BrotliStateTreeGroupsInit(s, kNumLiteralCodes,
+                                         kNumInsertAndCopyCodes,
+                                         num_distance_codes)) {
+            result = BROTLI_FAILURE();
+            break;
+          }
         }
         i = 0;
         s->state = BROTLI_STATE_TREE_GROUP;
@@ -1288,6 +1832,16 @@ BrotliResult BrotliDecompressStreaming(BrotliInput input, BrotliOutput output,
               &kContextLookup[kContextLookupOffsets[context_mode + 1]];
           s->htree_command = s->insert_copy_hgroup.htrees[0];
           s->literal_htree = s->literal_hgroup.htrees[s->literal_htree_index];
+          if (s->literal_pair_tables) {
+            int j;
+            for (j = 0; j < s->num_literal_htrees; ++j) {
+              BrotliBuildHuffmanPairTable(
+                  s->literal_pair_tables + j * BROTLI_HUFFMAN_PAIR_TABLE_SIZE,
+                  s->literal_hgroup.htrees[j], HUFFMAN_TABLE_BITS);
+            }
+            s->literal_pair_table = s->literal_pair_tables +
+                s->literal_htree_index * BROTLI_HUFFMAN_PAIR_TABLE_SIZE;
+          }
           s->state = BROTLI_STATE_COMMAND_BEGIN;
         }
         break;
@@ -1338,7 +1892,51 @@ BrotliResult BrotliDecompressStreaming(BrotliInput input, BrotliOutput output,
         /* No break, go to next state */
       case BROTLI_STATE_COMMAND_INNER:
         /* Read the literals in the command */
-        if (s->trivial_literal_context) {
+        if (s->literal_pair_table && i >= 4) {
+          /* Short literal runs are decoded one by one below, they do not
+             gain enough from the pair table to pay for the extra checks. */
+          do {
+            const HuffmanPairCode* pair;
+            if (!BrotliCheckInputAmount(br, 64)) {
+              s->state = BROTLI_STATE_COMMAND_INNER;
+              result = BROTLI_RESULT_NEEDS_MORE_INPUT;
+              break;
+            }
+            if (PREDICT_FALSE(s->block_length[0] == 0)) {
+              /* Block switch for literals */
+              DecodeBlockTypeWithContext(s, br);
+            }
+            BROTLI_LOG_UINT(s->literal_htree_index);
+            /* Decode one or two literals with one look-up, if the command,
+               the block and the ring buffer have room for two. Both bytes are
+               written, a second byte that was not decoded is overwritten by
+               the next literal or copy. */
+            pair = &s->literal_pair_table[
+                BrotliGetBits(br, BROTLI_HUFFMAN_PAIR_TABLE_BITS)];
+            if (PREDICT_TRUE(pair->num_literals != 0) && i >= 2 &&
+                s->block_length[0] >= 2 && pos + 2 <= s->ringbuffer_size) {
+              const int num_literals = pair->num_literals;
+              BrotliDropBits(br, pair->bits);
+              s->ringbuffer[pos] = pair->literals[0];
+              s->ringbuffer[pos + 1] = pair->literals[1];
+              BROTLI_LOG_ARRAY_INDEX(s->ringbuffer, pos);
+              s->block_length[0] -= num_literals;
+              pos += num_literals;
+              i -= num_literals - 1;
+            } else {
+              s->ringbuffer[pos] = (uint8_t)ReadSymbol(s->literal_htree, br);
+              BROTLI_LOG_ARRAY_INDEX(s->ringbuffer, pos);
+              --s->block_length[0];
+              ++pos;
+            }
+            if (PREDICT_FALSE(pos == s->ringbuffer_size)) {
+              s->to_write = s->ringbuffer_size;
+              s->state = BROTLI_STATE_COMMAND_INNER_WRITE;
+              --i;
+              goto innerWrite;
+            }
+          } while (--i != 0);
+        } else if (s->trivial_literal_context) {
           unsigned bits;
           unsigned value;
           PreloadSymbol(s->literal_htree, br, &bits, &value);
@@ -1362,15 +1960,21 @@ BrotliResult BrotliDecompressStreaming(BrotliInput input, BrotliOutput output,
             ++pos;
             if (PREDICT_FALSE(pos == s->ringbuffer_size)) {
               s->to_write = s->ringbuffer_size;
-              s->partially_written = 0;
               s->state = BROTLI_STATE_COMMAND_INNER_WRITE;
               --i;
               goto innerWrite;
             }
           } while (--i != 0);
         } else {
-          uint8_t p1 = s->ringbuffer[(pos - 1) & s->ringbuffer_mask];
-          uint8_t p2 = s->ringbuffer[(pos - 2) & s->ringbuffer_mask];
+          uint8_t p1 = 0;
+          uint8_t p2 = 0;
+          if (PREDICT_TRUE(pos >= 2) || !s->ringbuffer_is_output) {
+            p1 = s->ringbuffer[(pos - 1) & s->ringbuffer_mask];
+            p2 = s->ringbuffer[(pos - 2) & s->ringbuffer_mask];
+          } else if (pos == 1) {
+            /* The output buffer has no zeroes before the stream start. */
+            p1 = s->ringbuffer[0];
+          }
           do {
             const HuffmanCode* hc;
             if (!BrotliCheckInputAmount(br, 64)) {
@@ -1394,7 +1998,6 @@ BrotliResult BrotliDecompressStreaming(BrotliInput input, BrotliOutput output,
             ++pos;
             if (PREDICT_FALSE(pos == s->ringbuffer_size)) {
               s->to_write = s->ringbuffer_size;
-              s->partially_written = 0;
               s->state = BROTLI_STATE_COMMAND_INNER_WRITE;
               --i;
               goto innerWrite;
@@ -1507,7 +2110,18 @@ postReadDistance:
             if (transform_idx < kNumTransforms) {
               const uint8_t* word = &kBrotliDictionary[offset];
               int len = i;
-              if (transform_idx == 0) {
+              if (PREDICT_FALSE(&s->ringbuffer[pos] >= s->ringbuffer_end) &&
+                  s->ringbuffer_is_output) {
+                /* Only write what fits into the output buffer. */
+                uint8_t transformed[kOutputRingBufferSlack];
+                len = TransformDictionaryWord(
+                    transformed, word, len, transform_idx);
+                if (len > s->ringbuffer_size - pos) {
+                  result = BROTLI_FAILURE();
+                  break;
+                }
+                memcpy(&s->ringbuffer[pos], transformed, (size_t)len);
+              } else if (transform_idx == 0) {
                 memcpy(&s->ringbuffer[pos], word, (size_t)len);
               } else {
                 len = TransformDictionaryWord(
@@ -1517,7 +2131,6 @@ postReadDistance:
               s->meta_block_remaining_len -= len;
               if (pos >= s->ringbuffer_size) {
                 s->to_write = s->ringbuffer_size;
-                s->partially_written = 0;
                 s->state = BROTLI_STATE_COMMAND_POST_WRITE_1;
                 break;
               }
@@ -1539,6 +2152,16 @@ postReadDistance:
         } else {
           const uint8_t *ringbuffer_end_minus_copy_length =
               s->ringbuffer_end - i;
+          if (PREDICT_FALSE(s->custom_dict_is_missing) &&
+              s->distance_code > pos) {
+            /* Before the ring buffer wraps around, it holds only the output
+               since the seek point. */
+            BROTLI_LOG(("Invalid backward reference. pos: %d distance: %d "
+                   "len: %d bytes left: %d\n", pos, s->distance_code, i,
+                   s->meta_block_remaining_len));
+            result = BROTLI_FAILURE();
+            break;
+          }
           copy_src = &s->ringbuffer[(pos - s->distance_code) &
                                     s->ringbuffer_mask];
           copy_dst = &s->ringbuffer[pos];
@@ -1553,12 +2176,7 @@ postReadDistance:
             result = BROTLI_FAILURE();
             break;
           }
-          /* There is 128+ bytes of slack in the ringbuffer allocation.
-             Also, we have 16 short codes, that make these 16 bytes irrelevant
-             in the ringbuffer. Let's copy over them as a first guess.
-           */
-          memmove16(copy_dst, copy_src);
-          /* Now check if the copy extends over the ringbuffer end,
+          /* Check if the copy extends over the ringbuffer end,
              or if the copy overlaps with itself, if yes, do wrap-copy. */
           if (copy_src < copy_dst) {
             if (copy_dst >= ringbuffer_end_minus_copy_length) {
@@ -1575,6 +2193,11 @@ postReadDistance:
               goto postSelfintersecting;
             }
           }
+          /* There is 128+ bytes of slack after ringbuffer_end. Also, we have
+             16 short codes, that make these 16 bytes irrelevant in the
+             ringbuffer. Let's copy over them as a first guess.
+           */
+          memmove16(copy_dst, copy_src);
           pos += i;
           if (i > 16) {
             if (i > 32) {
@@ -1616,7 +2239,6 @@ postReadDistance:
           ++pos;
           if (pos == s->ringbuffer_size) {
             s->to_write = s->ringbuffer_size;
-            s->partially_written = 0;
             s->state = BROTLI_STATE_COMMAND_POST_WRITE_2;
             break;
           }
@@ -1635,12 +2257,24 @@ postReadDistance:
       case BROTLI_STATE_COMMAND_POST_WRITE_1:
       case BROTLI_STATE_COMMAND_POST_WRITE_2:
 innerWrite:
+        if (s->ringbuffer_is_output) {
+          /* The output buffer is full, so the meta-block has to end here. */
+          if (s->meta_block_remaining_len != 0 ||
+              (s->state != BROTLI_STATE_COMMAND_POST_WRITE_1 && i != 0)) {
+            result = BROTLI_FAILURE();
+            break;
+          }
+          s->state = BROTLI_STATE_METABLOCK_DONE;
+          break;
+        }
         result = WriteRingBuffer(output, s);
         if (result != BROTLI_RESULT_SUCCESS) {
           break;
         }
+        s->partially_written = 0;
         pos -= s->ringbuffer_size;
         s->max_distance = s->max_backward_distance;
+        s->custom_dict_is_missing = 0;
         if (s->state == BROTLI_STATE_COMMAND_POST_WRITE_1) {
           memcpy(s->ringbuffer, s->ringbuffer_end, (size_t)pos);
           if (s->meta_block_remaining_len <= 0) {
@@ -1670,7 +2304,6 @@ innerWrite:
           break;
         }
         s->to_write = pos;
-        s->partially_written = 0;
         s->state = BROTLI_STATE_DONE;
         /* No break, continue to next state */
       case BROTLI_STATE_DONE:
@@ -54,7 +54,9 @@ static inline BrotliResult BrotliFailure(const char *f, int l, const char *fn) {
 /* Sets *decoded_size to the decompressed size of the given encoded stream. */
 /* This function only works if the encoded buffer has a single meta block, */
 /* or if it has two meta-blocks, where the first is uncompressed and the */
-/* second is empty. */
+/* second is empty, or if it has a valid seek index, see */
+/* BrotliDecompressRange. The size in the seek index is only checked against */
+/* the index and the size of the stream, not against the data. */
 /* Returns 1 on success, 0 on failure. */
 int BrotliDecompressedSize(size_t encoded_size,
                            const uint8_t* encoded_buffer,
@@ -63,15 +65,45 @@ int BrotliDecompressedSize(size_t encoded_size,
 /* Decompresses the data in encoded_buffer into decoded_buffer, and sets */
 /* *decoded_size to the decompressed length. */
 /* Returns 0 if there was either a bit stream error or memory allocation */
-/* error, and 1 otherwise. */
+/* error, 3 if decoded_buffer is too small, and 1 otherwise. In the second */
+/* case, *decoded_size is set to the length of the start of the */
+/* decompressed data that is in decoded_buffer, which may be shorter than */
+/* decoded_buffer. */
 /* If decoded size is zero, returns 1 and keeps decoded_buffer unchanged. */
 BrotliResult BrotliDecompressBuffer(size_t encoded_size,
                                     const uint8_t* encoded_buffer,
                                     size_t* decoded_size,
                                     uint8_t* decoded_buffer);
 
-/* Same as above, but uses the specified input and output callbacks instead */
-/* of reading from and writing to pre-allocated memory buffers. */
+/* Decompresses the *decoded_size bytes that start offset bytes into the */
+/* decompressed data of encoded_buffer into decoded_buffer, and sets */
+/* *decoded_size to the number of bytes decompressed, which is smaller if */
+/* the decompressed data ends before. If the stream has a seek index, see */
+/* brotli::BrotliCompressSeekable, decoding starts at the last seek point */
+/* before offset, otherwise at the start of the stream. Decoding stops soon */
+/* after the end of the range, so the rest of the stream is not checked. */
+/* Sets *is_end to 1 if the decompressed data ends within the range or right */
+/* after it, and to 0 if it goes on after the range. */
+/* Returns 0 if there was either a bit stream error or memory allocation */
+/* error, and 1 otherwise. */
+BrotliResult BrotliDecompressRange(size_t encoded_size,
+                                   const uint8_t* encoded_buffer,
+                                   size_t offset,
+                                   size_t* decoded_size,
+                                   uint8_t* decoded_buffer,
+                                   int* is_end);
+
+/* Returns the number of seek points in the seek index of the stream in */
+/* encoded_buffer, or 0 if it has none, and stores the offsets of up to */
+/* max_points of them in the decompressed data in positions. */
+size_t BrotliGetSeekPoints(size_t encoded_size,
+                           const uint8_t* encoded_buffer,
+                           size_t max_points,
+                           size_t* positions);
+
+/* Same as BrotliDecompressBuffer, but uses the specified input and output */
+/* callbacks instead of reading from and writing to pre-allocated memory */
+/* buffers. */
 BrotliResult BrotliDecompress(BrotliInput input, BrotliOutput output);
 
 /* Same as above, but supports the caller to call the decoder repeatedly with
@@ -81,6 +113,8 @@ BrotliResult BrotliDecompress(BrotliInput input, BrotliOutput output);
    0: failure.
    1: success, and done.
    2: success so far, end not reached so should call again with more input.
+   3: success so far, but the output is full, so should call again when the
+      output can take more data.
    The finish parameter is used as follows, for a series of calls with the
    same state:
    0: Every call except the last one must be called with finish set to 0. The
@@ -91,13 +125,17 @@ BrotliResult BrotliDecompress(BrotliInput input, BrotliOutput output);
       if all input was already given to previous calls. It is also ok to have
       only one single call in total, with finish 1, and with all input
       available immediately. That matches the non-streaming case. If finish is
-      1, the function can only return 0 or 1, never 2. After a finish, no more
-      calls may be done.
+      1, the function can only return 0, 1 or 3, never 2. After a finish, no
+      more calls may be done.
    After everything is done, the state must be cleaned with BrotliStateCleanup
-   to free allocated resources.
-   The given BrotliOutput must always accept all output and make enough space,
-   it returning a smaller value than the amount of bytes to write always results
-   in an error.
+   to free allocated resources, or reset with BrotliStateReset to decode
+   another stream with the same state.
+   Decoded data is written to the output when the ring buffer wraps around,
+   when the stream ends, and when the function returns 2, so that it does not
+   wait for more input. If the given BrotliOutput accepts fewer bytes than it
+   is given, the function returns 3 (BROTLI_RESULT_NEEDS_MORE_OUTPUT) and must
+   be called again, with the same finish value and possibly more input, once
+   the output can take more data. The rest is written first then.
 */
 BrotliResult BrotliDecompressStreaming(BrotliInput input, BrotliOutput output,
                                        int finish, BrotliState* s);
@@ -118,16 +156,16 @@ BrotliResult BrotliDecompressStreaming(BrotliInput input, BrotliOutput output,
    The input may be partial. With each next function call, *next_in and
    *available_in must be updated to point to a next part of the compressed
    input. The current implementation will always consume all input unless
-   an error occurs, so normally *available_in will always be 0 after
-   calling this function and the next adjacent part of input is desired.
-
-   In the current implementation, the function requires that there is enough
-   output buffer size to write all currently processed input, so
-   *available_out must be large enough. Since the function updates *next_out
-   each time, as long as the output buffer is large enough you can keep
-   reusing this variable. It is also possible to update *next_out and
-   *available_out yourself before a next call, e.g. to point to a new larger
-   buffer.
+   an error occurs or the output is full, so *available_in will always be 0
+   after the function returns BROTLI_RESULT_NEEDS_MORE_INPUT.
+
+   The output buffer may be of any size. If it is full before all decoded
+   data is written, the function returns BROTLI_RESULT_NEEDS_MORE_OUTPUT and
+   stops decoding; input that was not consumed yet is left in *next_in. A
+   fixed buffer can then be drained and passed in again by resetting
+   *next_out and *available_out before the next call. Since the function
+   updates *next_out each time, you can also keep reusing this variable as
+   long as the output buffer is large enough.
 */
 BrotliResult BrotliDecompressBufferStreaming(size_t* available_in,
                                              const uint8_t** next_in,
@@ -0,0 +1,198 @@
+/* Copyright 2015 Google Inc. All Rights Reserved.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+/* Implementation of parallel Brotli decompression */
+
+#include <stdlib.h>
+#include "./decode_parallel.h"
+
+/* The worker threads are POSIX threads. Where there are none, as on Windows,
+   or if BROTLI_DEC_NO_THREADS is defined, all parts are decompressed on the
+   calling thread. */
+#if !defined(_WIN32) && !defined(BROTLI_DEC_NO_THREADS)
+#define BROTLI_DEC_THREADS
+#include <pthread.h>
+#endif
+
+#if defined(__cplusplus) || defined(c_plusplus)
+extern "C" {
+#endif
+
+#ifdef BROTLI_DEC_THREADS
+typedef pthread_t BrotliThread;
+typedef pthread_mutex_t BrotliMutex;
+#define BROTLI_MUTEX_INIT(m) pthread_mutex_init(m, NULL)
+#define BROTLI_MUTEX_DESTROY(m) pthread_mutex_destroy(m)
+#define BROTLI_MUTEX_LOCK(m) pthread_mutex_lock(m)
+#define BROTLI_MUTEX_UNLOCK(m) pthread_mutex_unlock(m)
+#else
+typedef int BrotliThread;
+typedef int BrotliMutex;
+#define BROTLI_MUTEX_INIT(m) ((void)(m))
+#define BROTLI_MUTEX_DESTROY(m) ((void)(m))
+#define BROTLI_MUTEX_LOCK(m) ((void)(m))
+#define BROTLI_MUTEX_UNLOCK(m) ((void)(m))
+#endif
+
+/* The work shared by the decoding threads. Part i of the output starts at
+   starts[i] and ends at starts[i + 1], except for the last part, which ends
+   where the decompressed data does. */
+typedef struct {
+  size_t encoded_size;
+  const uint8_t* encoded_buffer;
+  size_t decoded_size;
+  uint8_t* decoded_buffer;
+  const size_t* starts;
+  size_t num_parts;
+  BrotliMutex mutex;
+  /* The fields below are protected by mutex. */
+  size_t next_part;
+  BrotliResult result;
+  size_t last_part_size;
+} BrotliParallelDecoder;
+
+/* Decompresses part i of the output and returns the result. */
+static BrotliResult DecodePart(BrotliParallelDecoder* d, size_t i,
+                               size_t* size) {
+  const size_t start = d->starts[i];
+  const size_t end =
+      i + 1 < d->num_parts ? d->starts[i + 1] : d->decoded_size;
+  BrotliResult result;
+  int is_end;
+  if (start > end || end > d->decoded_size) {
+    /* The seek points are out of order or beyond the output buffer. */
+    return start > end ? BROTLI_FAILURE() : BROTLI_RESULT_NEEDS_MORE_OUTPUT;
+  }
+  *size = end - start;
+  result = BrotliDecompressRange(d->encoded_size, d->encoded_buffer, start,
+                                 size, d->decoded_buffer + start, &is_end);
+  if (result != BROTLI_RESULT_SUCCESS) {
+    return result;
+  }
+  if (i + 1 < d->num_parts) {
+    /* The data has to go on after every part except for the last. */
+    return is_end ? BROTLI_FAILURE() : BROTLI_RESULT_SUCCESS;
+  }
+  /* If the data goes on after the last part, decoded_buffer is too small. */
+  return is_end ? BROTLI_RESULT_SUCCESS : BROTLI_RESULT_NEEDS_MORE_OUTPUT;
+}
+
+static void* DecodeParts(void* arg) {
+  BrotliParallelDecoder* d = (BrotliParallelDecoder*)arg;
+  for (;;) {
+    size_t i;
+    size_t size = 0;
+    BrotliResult result;
+    BROTLI_MUTEX_LOCK(&d->mutex);
+    if (d->next_part == d->num_parts ||
+        d->result != BROTLI_RESULT_SUCCESS) {
+      BROTLI_MUTEX_UNLOCK(&d->mutex);
+      return NULL;
+    }
+    i = d->next_part++;
+    BROTLI_MUTEX_UNLOCK(&d->mutex);
+    result = DecodePart(d, i, &size);
+    BROTLI_MUTEX_LOCK(&d->mutex);
+    if (result != BROTLI_RESULT_SUCCESS &&
+        d->result == BROTLI_RESULT_SUCCESS) {
+      d->result = result;
+    }
+    if (i + 1 == d->num_parts) {
+      d->last_part_size = size;
+    }
+    BROTLI_MUTEX_UNLOCK(&d->mutex);
+  }
+}
+
+/* Starts up to n threads that run DecodeParts and returns their number. */
+static int StartThreads(BrotliParallelDecoder* d, int n,
+                        BrotliThread* threads) {
+  int num_started = 0;
+#ifdef BROTLI_DEC_THREADS
+  while (num_started < n &&
+         pthread_create(&threads[num_started], NULL, DecodeParts, d) == 0) {
+    ++num_started;
+  }
+#endif
+  return num_started;
+}
+
+static void JoinThreads(int n, BrotliThread* threads) {
+#ifdef BROTLI_DEC_THREADS
+  int i;
+  for (i = 0; i < n; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+#endif
+}
+
+BrotliResult BrotliDecompressBufferParallel(size_t encoded_size,
+                                            const uint8_t* encoded_buffer,
+                                            int num_threads,
+                                            size_t* decoded_size,
+                                            uint8_t* decoded_buffer) {
+  BrotliParallelDecoder d;
+  size_t* starts;
+  BrotliThread* threads;
+  int num_started = 0;
+  size_t num_points = BrotliGetSeekPoints(encoded_size, encoded_buffer, 0,
+                                          NULL);
+  if (num_points == 0) {
+    return BrotliDecompressBuffer(encoded_size, encoded_buffer, decoded_size,
+                                  decoded_buffer);
+  }
+  /* The first part goes from the start of the stream to the first seek
+     point. */
+  starts = (size_t*)malloc((num_points + 1) * sizeof(starts[0]));
+  if (starts == NULL) {
+    return BROTLI_FAILURE();
+  }
+  starts[0] = 0;
+  BrotliGetSeekPoints(encoded_size, encoded_buffer, num_points, starts + 1);
+  d.encoded_size = encoded_size;
+  d.encoded_buffer = encoded_buffer;
+  d.decoded_size = *decoded_size;
+  d.decoded_buffer = decoded_buffer;
+  d.starts = starts;
+  d.num_parts = num_points + 1;
+  d.next_part = 0;
+  d.result = BROTLI_RESULT_SUCCESS;
+  d.last_part_size = 0;
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+  if ((size_t)num_threads > d.num_parts) {
+    num_threads = (int)d.num_parts;
+  }
+  BROTLI_MUTEX_INIT(&d.mutex);
+  /* The calling thread is one of the decoding threads. */
+  threads = (BrotliThread*)malloc((size_t)num_threads * sizeof(threads[0]));
+  if (threads != NULL) {
+    num_started = StartThreads(&d, num_threads - 1, threads);
+  }
+  DecodeParts(&d);
+  JoinThreads(num_started, threads);
+  BROTLI_MUTEX_DESTROY(&d.mutex);
+  if (d.result == BROTLI_RESULT_SUCCESS) {
+    *decoded_size = starts[num_points] + d.last_part_size;
+  }
+  free(threads);
+  free(starts);
+  return d.result;
+}
+
+#if defined(__cplusplus) || defined(c_plusplus)
+} /* extern "C" */
+#endif
@@ -0,0 +1,48 @@
+/* Copyright 2015 Google Inc. All Rights Reserved.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+/* API for parallel Brotli decompression */
+
+#ifndef BROTLI_DEC_DECODE_PARALLEL_H_
+#define BROTLI_DEC_DECODE_PARALLEL_H_
+
+#include "./decode.h"
+#include "./types.h"
+
+#if defined(__cplusplus) || defined(c_plusplus)
+extern "C" {
+#endif
+
+/* Same as BrotliDecompressBuffer, but if the stream has a seek index, see */
+/* brotli::BrotliCompressSeekable, the parts of the decompressed data */
+/* between its seek points are decompressed with BrotliDecompressRange on */
+/* up to num_threads threads. Each part is decoded through a ring buffer of */
+/* its own and copied from there into its part of decoded_buffer. Streams */
+/* without a seek index are decompressed on the calling thread, and so is */
+/* everything where there are no POSIX threads, as on Windows, or if */
+/* BROTLI_DEC_NO_THREADS is defined. */
+/* Returns 0 if there was either a bit stream error or memory allocation */
+/* error, 3 if decoded_buffer is too small, and 1 otherwise. */
+BrotliResult BrotliDecompressBufferParallel(size_t encoded_size,
+                                            const uint8_t* encoded_buffer,
+                                            int num_threads,
+                                            size_t* decoded_size,
+                                            uint8_t* decoded_buffer);
+
+#if defined(__cplusplus) || defined(c_plusplus)
+} /* extern "C" */
+#endif
+
+#endif  /* BROTLI_DEC_DECODE_PARALLEL_H_ */
@@ -301,22 +301,52 @@ int BrotliBuildSimpleHuffmanTable(HuffmanCode* table,
   return goal_size;
 }
 
-void BrotliHuffmanTreeGroupInit(HuffmanTreeGroup* group, int alphabet_size,
-                                int ntrees) {
-  /* Pack two mallocs into one */
-  const size_t code_size =
-      sizeof(HuffmanCode) * (size_t)(ntrees * BROTLI_HUFFMAN_MAX_TABLE_SIZE);
-  const size_t htree_size = sizeof(HuffmanCode*) * (size_t)ntrees;
-  char *p = (char*)malloc(code_size + htree_size);
-  group->alphabet_size = (int16_t)alphabet_size;
-  group->num_htrees = (int16_t)ntrees;
-  group->codes = (HuffmanCode*)p;
-  group->htrees = (HuffmanCode**)(p + code_size);
+/* Decodes the code in the low bits of key with the given table, like
+   ReadSymbol in decode.c. Returns the length of the code, which is only
+   valid if it is not larger than the number of bits in key. */
+static int DecodeKey(const HuffmanCode* root_table, int root_bits,
+                     uint32_t key, int* symbol) {
+  const HuffmanCode* table = &root_table[key & ((1u << root_bits) - 1)];
+  int length = 0;
+  if (table->bits > root_bits) {
+    int nbits = table->bits - root_bits;
+    table += table->value;
+    table += (key >> root_bits) & ((1u << nbits) - 1);
+    length = root_bits;
+  }
+  *symbol = table->value;
+  return length + table->bits;
 }
 
-void BrotliHuffmanTreeGroupRelease(HuffmanTreeGroup* group) {
-  if (group->codes) {
-    free(group->codes);
+void BrotliBuildHuffmanPairTable(HuffmanPairCode* pair_table,
+                                 const HuffmanCode* root_table,
+                                 int root_bits) {
+  const uint32_t table_size = 1u << BROTLI_HUFFMAN_PAIR_TABLE_BITS;
+  uint32_t key;
+  for (key = 0; key < table_size; ++key) {
+    HuffmanPairCode* pair = &pair_table[key];
+    int first;
+    int second;
+    int first_bits = DecodeKey(root_table, root_bits, key, &first);
+    int second_bits;
+    if (first_bits > BROTLI_HUFFMAN_PAIR_TABLE_BITS) {
+      pair->bits = 0;
+      pair->num_literals = 0;
+      continue;
+    }
+    /* The bits after the first code are the high bits of the key, so the
+       second code can be decoded from them if it is short enough. */
+    second_bits = DecodeKey(root_table, root_bits, key >> first_bits, &second);
+    pair->literals[0] = (uint8_t)first;
+    if (first_bits + second_bits <= BROTLI_HUFFMAN_PAIR_TABLE_BITS) {
+      pair->bits = (uint8_t)(first_bits + second_bits);
+      pair->num_literals = 2;
+      pair->literals[1] = (uint8_t)second;
+    } else {
+      pair->bits = (uint8_t)first_bits;
+      pair->num_literals = 1;
+      pair->literals[1] = 0;
+    }
   }
 }
 
@@ -40,6 +40,16 @@ typedef struct {
   uint16_t value;   /* symbol value or table offset */
 } HuffmanCode;
 
+/* Entry of a table that decodes up to two literals with a single look-up. */
+typedef struct {
+  uint8_t bits;          /* total number of bits of the decoded literals */
+  uint8_t num_literals;  /* 0 if the first code does not fit */
+  uint8_t literals[2];
+} HuffmanPairCode;
+
+/* Number of bits looked up in a pair table, and its number of entries. */
+#define BROTLI_HUFFMAN_PAIR_TABLE_BITS 10
+#define BROTLI_HUFFMAN_PAIR_TABLE_SIZE (1 << BROTLI_HUFFMAN_PAIR_TABLE_BITS)
 
 /* Builds Huffman lookup table assuming code lengths are in symbol order. */
 void BrotliBuildCodeLengthsHuffmanTable(HuffmanCode* root_table,
@@ -62,6 +72,14 @@ int BrotliBuildSimpleHuffmanTable(HuffmanCode* table,
                                   uint16_t *symbols,
                                   uint32_t num_symbols);
 
+/* Builds pair_table from the table of a literal Huffman code with root_bits
+   root bits. An entry holds two literals if both codes fit into its
+   BROTLI_HUFFMAN_PAIR_TABLE_BITS bits together, otherwise only the first
+   one, if it fits. */
+void BrotliBuildHuffmanPairTable(HuffmanPairCode* pair_table,
+                                 const HuffmanCode* root_table,
+                                 int root_bits);
+
 /* Contains a collection of Huffman trees with the same alphabet size. */
 typedef struct {
   HuffmanCode** htrees;
@@ -70,10 +88,6 @@ typedef struct {
   int16_t num_htrees;
 } HuffmanTreeGroup;
 
-void BrotliHuffmanTreeGroupInit(HuffmanTreeGroup* group,
-                                int alphabet_size, int ntrees);
-void BrotliHuffmanTreeGroupRelease(HuffmanTreeGroup* group);
-
 #if defined(__cplusplus) || defined(c_plusplus)
 }    /* extern "C" */
 #endif
@@ -0,0 +1,37 @@
+/* Copyright 2015 Google Inc. All Rights Reserved.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+/* Layout of the seek index of a seekable stream, which the encoder writes
+   and the decoder reads.
+
+   The seek index is the payload of the metadata meta-block before the last,
+   empty meta-block of a stream, so it ends one byte before the end of the
+   stream. It consists of the seek points, each with the 8-byte uncompressed
+   and compressed offsets of a meta-block that does not depend on the data
+   before it and the last two bytes before it, followed by the trailer: the
+   8-byte size of the decompressed data, the 4-byte number of seek points and
+   the magic bytes. All numbers are little-endian.
+*/
+
+#ifndef BROTLI_DEC_SEEK_INDEX_H_
+#define BROTLI_DEC_SEEK_INDEX_H_
+
+#include "./types.h"
+
+static const uint8_t kSeekIndexMagic[4] = { 'B', 'r', 'S', 'k' };
+static const size_t kSeekPointSize = 18;
+static const size_t kSeekIndexTrailerSize = 16;
+
+#endif  /* BROTLI_DEC_SEEK_INDEX_H_ */
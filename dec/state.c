@@ -23,7 +23,76 @@
 extern "C" {
 #endif
 
-void BrotliStateInit(BrotliState* s) {
+static void* DefaultAllocFunc(void* opaque, size_t size) {
+  (void)opaque;
+  return malloc(size);
+}
+
+static void DefaultFreeFunc(void* opaque, void* address) {
+  (void)opaque;
+  free(address);
+}
+
+/* The fixed arena is a sequence of blocks, each starting with a header, and
+   terminated by a header of size 0. Allocation takes the first free block
+   that is large enough, merging adjacent free blocks on the way. The state
+   allocates only a handful of blocks at a time, so a linear scan is cheap. */
+typedef struct {
+  /* Size of the block including the header, 0 for the terminator. */
+  size_t size;
+  size_t is_free;
+} BrotliArenaBlock;
+
+#define BROTLI_ARENA_ALIGNMENT 16
+#define BROTLI_ARENA_ALIGN(X) \
+    (((X) + BROTLI_ARENA_ALIGNMENT - 1) & ~(size_t)(BROTLI_ARENA_ALIGNMENT - 1))
+#define BROTLI_ARENA_HEADER_SIZE BROTLI_ARENA_ALIGN(sizeof(BrotliArenaBlock))
+
+static BrotliArenaBlock* NextArenaBlock(BrotliArenaBlock* block) {
+  return (BrotliArenaBlock*)((uint8_t*)block + block->size);
+}
+
+static void* ArenaAllocFunc(void* opaque, size_t size) {
+  BrotliArenaBlock* block = (BrotliArenaBlock*)opaque;
+  const size_t needed = BROTLI_ARENA_HEADER_SIZE + BROTLI_ARENA_ALIGN(size);
+  if (block == NULL) {
+    return NULL;
+  }
+  for (; block->size != 0; block = NextArenaBlock(block)) {
+    BrotliArenaBlock* next;
+    if (!block->is_free) {
+      continue;
+    }
+    next = NextArenaBlock(block);
+    while (next->size != 0 && next->is_free) {
+      block->size += next->size;
+      next = NextArenaBlock(block);
+    }
+    if (block->size < needed) {
+      continue;
+    }
+    if (block->size - needed >= 2 * BROTLI_ARENA_HEADER_SIZE) {
+      next = (BrotliArenaBlock*)((uint8_t*)block + needed);
+      next->size = block->size - needed;
+      next->is_free = 1;
+      block->size = needed;
+    }
+    block->is_free = 0;
+    return (uint8_t*)block + BROTLI_ARENA_HEADER_SIZE;
+  }
+  return NULL;
+}
+
+static void ArenaFreeFunc(void* opaque, void* address) {
+  (void)opaque;
+  if (address != NULL) {
+    BrotliArenaBlock* block = (BrotliArenaBlock*)
+        ((uint8_t*)address - BROTLI_ARENA_HEADER_SIZE);
+    block->is_free = 1;
+  }
+}
+
+static void InitStreamState(BrotliState* s) {
   s->state = BROTLI_STATE_UNINITED;
   s->substate_metablock_header = BROTLI_STATE_METABLOCK_HEADER_NONE;
   s->substate_tree_group = BROTLI_STATE_TREE_GROUP_NONE;
@@ -31,27 +100,17 @@ void BrotliStateInit(BrotliState* s) {
   s->substate_uncompressed = BROTLI_STATE_UNCOMPRESSED_NONE;
   s->substate_huffman = BROTLI_STATE_HUFFMAN_NONE;
   s->substate_decode_uint8 = BROTLI_STATE_DECODE_UINT8_NONE;
+  s->loop_counter = 0;
+  s->pos = 0;
+  s->to_write = 0;
+  s->partially_written = 0;
 
-  s->block_type_trees = NULL;
-  s->block_len_trees = NULL;
-  s->ringbuffer = NULL;
-
-  s->context_map = NULL;
-  s->context_modes = NULL;
-  s->dist_context_map = NULL;
   s->context_map_slice = NULL;
   s->dist_context_map_slice = NULL;
 
-  s->literal_hgroup.codes = NULL;
-  s->literal_hgroup.htrees = NULL;
-  s->insert_copy_hgroup.codes = NULL;
-  s->insert_copy_hgroup.htrees = NULL;
-  s->distance_hgroup.codes = NULL;
-  s->distance_hgroup.htrees = NULL;
-
-
   s->custom_dict = NULL;
   s->custom_dict_size = 0;
+  s->custom_dict_is_missing = 0;
 
   s->is_last_metablock = 0;
   s->window_bits = 0;
@@ -61,8 +120,6 @@ void BrotliStateInit(BrotliState* s) {
   s->dist_rb[2] = 11;
   s->dist_rb[3] = 4;
   s->dist_rb_idx = 0;
-  s->block_type_trees = NULL;
-  s->block_len_trees = NULL;
 
   /* Make small negative indexes addressable. */
   s->symbol_lists = &s->symbols_lists_array[BROTLI_HUFFMAN_MAX_CODE_LENGTH + 1];
@@ -70,6 +127,85 @@ void BrotliStateInit(BrotliState* s) {
   s->mtf_upper_bound = 255;
 }
 
+void BrotliStateInit(BrotliState* s) {
+  BrotliStateInitWithCustomAllocators(s, 0, 0, 0);
+}
+
+void BrotliStateInitWithArena(BrotliState* s, void* arena, size_t arena_size) {
+  uint8_t* start = (uint8_t*)BROTLI_ARENA_ALIGN((size_t)arena);
+  BrotliArenaBlock* first = NULL;
+  size_t skipped = (size_t)(start - (uint8_t*)arena);
+  if (arena_size >= skipped + 3 * BROTLI_ARENA_HEADER_SIZE) {
+    /* One free block spanning the arena, followed by the terminator. */
+    size_t size = arena_size - skipped;
+    BrotliArenaBlock* terminator;
+    size &= ~(size_t)(BROTLI_ARENA_ALIGNMENT - 1);
+    size -= BROTLI_ARENA_HEADER_SIZE;
+    first = (BrotliArenaBlock*)start;
+    first->size = size;
+    first->is_free = 1;
+    terminator = (BrotliArenaBlock*)(start + size);
+    terminator->size = 0;
+    terminator->is_free = 0;
+  }
+  BrotliStateInitWithCustomAllocators(s, ArenaAllocFunc, ArenaFreeFunc, first);
+}
+
+void BrotliStateInitWithCustomAllocators(BrotliState* s,
+                                         brotli_alloc_func alloc_func,
+                                         brotli_free_func free_func,
+                                         void* opaque) {
+  if (!alloc_func) {
+    s->alloc_func = DefaultAllocFunc;
+    s->free_func = DefaultFreeFunc;
+    s->memory_manager_opaque = 0;
+  } else {
+    s->alloc_func = alloc_func;
+    s->free_func = free_func;
+    s->memory_manager_opaque = opaque;
+  }
+
+  s->block_type_trees = NULL;
+  s->block_len_trees = NULL;
+  s->ringbuffer = NULL;
+  s->spare_ringbuffer = NULL;
+  s->ringbuffer_capacity = 0;
+  s->ringbuffer_is_output = 0;
+
+  s->context_map = NULL;
+  s->context_modes = NULL;
+  s->dist_context_map = NULL;
+
+  s->literal_hgroup.codes = NULL;
+  s->literal_hgroup.htrees = NULL;
+  s->insert_copy_hgroup.codes = NULL;
+  s->insert_copy_hgroup.htrees = NULL;
+  s->distance_hgroup.codes = NULL;
+  s->distance_hgroup.htrees = NULL;
+  s->tree_group_memory = NULL;
+  s->tree_group_memory_size = 0;
+
+  InitStreamState(s);
+}
+
+void BrotliStateReset(BrotliState* s) {
+  BrotliStateCleanupAfterMetablock(s);
+  /* The ring buffer is reused by the next stream if it is large enough, see
+     BrotliAllocateRingBuffer. */
+  if (s->ringbuffer != 0) {
+    s->spare_ringbuffer = s->ringbuffer;
+    s->ringbuffer = NULL;
+    s->ringbuffer_end = NULL;
+  }
+  InitStreamState(s);
+}
+
+void BrotliStateSetInputBuffer(BrotliState* s, BrotliInput input,
+                               const uint8_t* data, uint32_t size) {
+  BrotliInitBitReaderWithBuffer(&s->br, input, data, size);
+  s->state = BROTLI_STATE_BITREADER_WARMUP;
+}
+
 void BrotliStateMetablockBegin(BrotliState* s) {
   s->meta_block_remaining_len = 0;
   s->block_length[0] = 1 << 28;
@@ -90,6 +226,8 @@ void BrotliStateMetablockBegin(BrotliState* s) {
   s->context_map_slice = NULL;
   s->literal_htree_index = 0;
   s->literal_htree = NULL;
+  s->literal_pair_tables = NULL;
+  s->literal_pair_table = NULL;
   s->dist_context_map_slice = NULL;
   s->dist_htree_index = 0;
   s->context_lookup1 = NULL;
@@ -104,21 +242,16 @@ void BrotliStateMetablockBegin(BrotliState* s) {
 
 void BrotliStateCleanupAfterMetablock(BrotliState* s) {
   if (s->context_modes != 0) {
-    free(s->context_modes);
-    s->context_modes = NULL;
+    BROTLI_FREE(s, s->context_modes);
   }
   if (s->context_map != 0) {
-    free(s->context_map);
-    s->context_map = NULL;
+    BROTLI_FREE(s, s->context_map);
   }
   if (s->dist_context_map != 0) {
-    free(s->dist_context_map);
-    s->dist_context_map = NULL;
+    BROTLI_FREE(s, s->dist_context_map);
   }
 
-  BrotliHuffmanTreeGroupRelease(&s->literal_hgroup);
-  BrotliHuffmanTreeGroupRelease(&s->insert_copy_hgroup);
-  BrotliHuffmanTreeGroupRelease(&s->distance_hgroup);
+  /* The memory of the tree groups is kept for the next meta-block. */
   s->literal_hgroup.codes = NULL;
   s->literal_hgroup.htrees = NULL;
   s->insert_copy_hgroup.codes = NULL;
@@ -128,25 +261,76 @@ void BrotliStateCleanupAfterMetablock(BrotliState* s) {
 }
 
 void BrotliStateCleanup(BrotliState* s) {
-  if (s->context_modes != 0) {
-    free(s->context_modes);
-  }
-  if (s->context_map != 0) {
-    free(s->context_map);
-  }
-  if (s->dist_context_map != 0) {
-    free(s->dist_context_map);
-  }
-  BrotliHuffmanTreeGroupRelease(&s->literal_hgroup);
-  BrotliHuffmanTreeGroupRelease(&s->insert_copy_hgroup);
-  BrotliHuffmanTreeGroupRelease(&s->distance_hgroup);
+  BrotliStateCleanupAfterMetablock(s);
 
   if (s->ringbuffer != 0) {
-    free(s->ringbuffer);
+    BROTLI_FREE(s, s->ringbuffer);
+  }
+  if (s->spare_ringbuffer != 0) {
+    BROTLI_FREE(s, s->spare_ringbuffer);
   }
   if (s->block_type_trees != 0) {
-    free(s->block_type_trees);
+    BROTLI_FREE(s, s->block_type_trees);
+  }
+  if (s->tree_group_memory != 0) {
+    BROTLI_FREE(s, s->tree_group_memory);
+  }
+}
+
+static size_t TreeGroupSize(int ntrees) {
+  return (sizeof(HuffmanCode) * BROTLI_HUFFMAN_MAX_TABLE_SIZE +
+          sizeof(HuffmanCode*)) * (size_t)ntrees;
+}
+
+/* Places the tables of the group at p, and returns the end of them. */
+static uint8_t* TreeGroupSetup(HuffmanTreeGroup* group, int alphabet_size,
+                               int ntrees, uint8_t* p) {
+  /* The code size is a multiple of 8 bytes, so the pointers are aligned. */
+  const size_t code_size =
+      sizeof(HuffmanCode) * (size_t)(ntrees * BROTLI_HUFFMAN_MAX_TABLE_SIZE);
+  group->alphabet_size = (int16_t)alphabet_size;
+  group->num_htrees = (int16_t)ntrees;
+  group->codes = (HuffmanCode*)p;
+  group->htrees = (HuffmanCode**)(p + code_size);
+  return p + TreeGroupSize(ntrees);
+}
+
+int BrotliStateTreeGroupsInit(BrotliState* s, int literal_alphabet_size,
+                              int insert_copy_alphabet_size,
+                              int distance_alphabet_size) {
+  /* Building a pair table costs about as much as decoding a few literals
+     per entry, so the tables are only used for meta-blocks that are long
+     enough to make up for it. */
+  const int use_pair_tables = s->trivial_literal_context &&
+      s->meta_block_remaining_len / 8 >=
+      BROTLI_HUFFMAN_PAIR_TABLE_SIZE * s->num_literal_htrees;
+  const size_t pair_tables_size = use_pair_tables ?
+      sizeof(HuffmanPairCode) * BROTLI_HUFFMAN_PAIR_TABLE_SIZE *
+      (size_t)s->num_literal_htrees : 0;
+  const size_t size = TreeGroupSize(s->num_literal_htrees) +
+      TreeGroupSize(s->num_block_types[1]) +
+      TreeGroupSize(s->num_dist_htrees) + pair_tables_size;
+  uint8_t* p;
+  if (size > s->tree_group_memory_size) {
+    if (s->tree_group_memory != 0) {
+      BROTLI_FREE(s, s->tree_group_memory);
+    }
+    s->tree_group_memory_size = 0;
+    s->tree_group_memory = (uint8_t*)BROTLI_ALLOC(s, size);
+    if (s->tree_group_memory == 0) {
+      return 0;
+    }
+    s->tree_group_memory_size = size;
   }
+  p = s->tree_group_memory;
+  p = TreeGroupSetup(&s->literal_hgroup, literal_alphabet_size,
+                     s->num_literal_htrees, p);
+  p = TreeGroupSetup(&s->insert_copy_hgroup, insert_copy_alphabet_size,
+                     s->num_block_types[1], p);
+  p = TreeGroupSetup(&s->distance_hgroup, distance_alphabet_size,
+                     s->num_dist_htrees, p);
+  s->literal_pair_tables = pair_tables_size ? (HuffmanPairCode*)p : NULL;
+  return 1;
 }
 
 #if defined(__cplusplus) || defined(c_plusplus)
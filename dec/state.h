@@ -98,6 +98,12 @@ typedef enum {
 
 typedef struct {
   BrotliRunningState state;
+  /* Memory management callbacks, all memory of the state is allocated and
+     released with them. */
+  brotli_alloc_func alloc_func;
+  brotli_free_func free_func;
+  void* memory_manager_opaque;
+
   /* This counter is reused for several disjoint loops. */
   BrotliBitReader br;
   int loop_counter;
@@ -111,6 +117,15 @@ typedef struct {
   int dist_rb[4];
   uint8_t* ringbuffer;
   uint8_t* ringbuffer_end;
+  /* Ring buffer of the previous stream, kept by BrotliStateReset. */
+  uint8_t* spare_ringbuffer;
+  /* Allocated size of ringbuffer or spare_ringbuffer, without the slack. */
+  int ringbuffer_capacity;
+  /* Set if ringbuffer is the output buffer given to BrotliDecompressBuffer.
+     It is filled from the start and never wraps around, ringbuffer_size is
+     the size of the output buffer and ringbuffer_end is kept before its end
+     by the size of the slack. */
+  int ringbuffer_is_output;
   HuffmanCode* htree_command;
   const uint8_t* context_lookup1;
   const uint8_t* context_lookup2;
@@ -122,6 +137,9 @@ typedef struct {
   HuffmanTreeGroup literal_hgroup;
   HuffmanTreeGroup insert_copy_hgroup;
   HuffmanTreeGroup distance_hgroup;
+  /* Memory of the tree groups, kept across meta-blocks. */
+  uint8_t* tree_group_memory;
+  size_t tree_group_memory_size;
   HuffmanCode* block_type_trees;
   HuffmanCode* block_len_trees;
   /* This is true if the literal context map histogram type always matches the
@@ -138,6 +156,9 @@ typedef struct {
   int num_dist_htrees;
   uint8_t* dist_context_map;
   HuffmanCode *literal_htree;
+  /* Pair tables of the literal trees, NULL if the meta-block has none. */
+  HuffmanPairCode* literal_pair_tables;
+  const HuffmanPairCode* literal_pair_table;
   uint8_t literal_htree_index;
   uint8_t dist_htree_index;
   uint8_t repeat_code_len;
@@ -147,7 +168,9 @@ typedef struct {
   int copy_length;
   int distance_code;
 
-  /* For partial write operations */
+  /* For partial write operations. The first partially_written bytes of the
+     ring buffer have been written to the output since it last wrapped
+     around. */
   int to_write;
   int partially_written;
 
@@ -184,6 +207,11 @@ typedef struct {
   /* For custom dictionaries */
   const uint8_t* custom_dict;
   int custom_dict_size;
+  /* Set when the decoding starts at a seek point. The output before it
+     counts as a custom dictionary for the distances, but it is not in the
+     ring buffer, so copies from it fail until the ring buffer wraps
+     around. */
+  int custom_dict_is_missing;
 
   /* less used attributes are in the end of this struct */
   /* States inside function calls */
@@ -209,10 +237,56 @@ typedef struct {
 } BrotliState;
 
 void BrotliStateInit(BrotliState* s);
+/* Same as above, but the memory of the state is allocated with alloc_func
+   and released with free_func, which are called with the given opaque
+   pointer. If both alloc_func and free_func are 0, malloc and free are used.
+   An allocation failure makes the decoder return BROTLI_RESULT_ERROR. */
+void BrotliStateInitWithCustomAllocators(BrotliState* s,
+                                         brotli_alloc_func alloc_func,
+                                         brotli_free_func free_func,
+                                         void* opaque);
+/* Same as above, but all memory of the state is taken from the given fixed
+   arena of arena_size bytes, which must exist until BrotliStateCleanup. No
+   other memory is allocated. Decoding fails if the arena is too small; a
+   stream with window_bits W needs up to about 1.5 * (1 << W) bytes for the
+   ring buffer while it grows to the window size, and up to about 1.2 MB for
+   the Huffman tables of a meta-block. Since each arena is used by one state
+   only, states in different threads do not contend for a common allocator. */
+void BrotliStateInitWithArena(BrotliState* s, void* arena, size_t arena_size);
 void BrotliStateCleanup(BrotliState* s);
+/* Prepares the state for decoding a new stream, like BrotliStateCleanup
+   followed by BrotliStateInit with the same allocators, but keeps the
+   memory that the next stream can use: the block type trees, the memory of
+   the tree groups, and the ring buffer if it is large enough for the window
+   size of the next stream. */
+void BrotliStateReset(BrotliState* s);
+/* Makes the decoder read the first size bytes of the stream directly from
+   data, and the rest through the input callback, see
+   BrotliInitBitReaderWithBuffer. Must be called before the first call of
+   BrotliDecompressStreaming for the stream, which then skips the usual
+   initialization of the bit reader. */
+void BrotliStateSetInputBuffer(BrotliState* s, BrotliInput input,
+                               const uint8_t* data, uint32_t size);
 void BrotliStateMetablockBegin(BrotliState* s);
 void BrotliStateCleanupAfterMetablock(BrotliState* s);
 
+/* Sets up the literal, insert-and-copy and distance tree groups of the
+   meta-block for the given alphabet sizes, with the number of trees taken
+   from the state, and the literal pair tables if the literal context is
+   trivial. The tables are taken from a buffer of the state that only
+   grows, so that it is allocated once for a series of similar meta-blocks.
+   Returns 0 if the memory could not be allocated. */
+int BrotliStateTreeGroupsInit(BrotliState* s, int literal_alphabet_size,
+                              int insert_copy_alphabet_size,
+                              int distance_alphabet_size);
+
+#define BROTLI_ALLOC(S, L) S->alloc_func(S->memory_manager_opaque, L)
+
+#define BROTLI_FREE(S, X) {                  \
+  S->free_func(S->memory_manager_opaque, X); \
+  X = NULL;                                  \
+}
+
 #if defined(__cplusplus) || defined(c_plusplus)
 } /* extern "C" */
 #endif
@@ -55,7 +55,10 @@ int BrotliMemOutputFunction(void* data, const uint8_t* buf, size_t count) {
   if (count > limit) {
     count = limit;
   }
-  memcpy(output->buffer + output->pos, buf, count);
+  /* The decoder can decode directly into the buffer. */
+  if (buf != output->buffer + output->pos) {
+    memcpy(output->buffer + output->pos, buf, count);
+  }
   output->pos += count;
   return (int)count;
 }
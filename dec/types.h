@@ -33,4 +33,14 @@ typedef long long int int64_t;
 #include <stdint.h>
 #endif  /* defined(_MSC_VER) && (_MSC_VER < 1600) */
 
+/* Allocating function pointer. Function MUST return 0 in the case of failure.
+   Otherwise it MUST return a valid pointer to a memory region of at least
+   size length. opaque is the pointer provided by the client, it can be used
+   to bind the function to a specific object (e.g. a memory pool). */
+typedef void* (*brotli_alloc_func) (void* opaque, size_t size);
+
+/* Deallocating function pointer. Function SHOULD be no-op in the case the
+   address is 0. */
+typedef void (*brotli_free_func) (void* opaque, void* address);
+
 #endif  /* BROTLI_DEC_TYPES_H_ */
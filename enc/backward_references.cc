@@ -22,14 +22,19 @@
 
 #include "./command.h"
 #include "./fast_log.h"
+#include "./memory.h"
 
 namespace brotli {
 
 static const double kInfinity = std::numeric_limits<double>::infinity();
 
-// Histogram based cost model for zopflification.
+// Histogram based cost model for zopflification. The cumulative literal costs
+// are stored in the given array of num_bytes + 1 elements.
 class ZopfliCostModel {
  public:
+  explicit ZopfliCostModel(double* literal_costs)
+      : literal_costs_(literal_costs) {}
+
   void SetFromCommands(size_t num_bytes,
                        size_t position,
                        const uint8_t* ringbuffer,
@@ -37,9 +42,9 @@ class ZopfliCostModel {
                        const Command* commands,
                        int num_commands,
                        int last_insert_len) {
-    std::vector<int> histogram_literal(256, 0);
-    std::vector<int> histogram_cmd(kNumCommandPrefixes, 0);
-    std::vector<int> histogram_dist(kNumDistancePrefixes, 0);
+    int histogram_literal[256] = { 0 };
+    int histogram_cmd[kNumCommandPrefixes] = { 0 };
+    int histogram_dist[kNumDistancePrefixes] = { 0 };
 
     size_t pos = position - last_insert_len;
     for (int i = 0; i < num_commands; i++) {
@@ -58,17 +63,16 @@ class ZopfliCostModel {
       pos += inslength + copylength;
     }
 
-    std::vector<double> cost_literal;
-    Set(histogram_literal, &cost_literal);
-    Set(histogram_cmd, &cost_cmd_);
-    Set(histogram_dist, &cost_dist_);
+    double cost_literal[256];
+    Set(histogram_literal, 256, cost_literal);
+    Set(histogram_cmd, kNumCommandPrefixes, cost_cmd_);
+    Set(histogram_dist, kNumDistancePrefixes, cost_dist_);
 
     min_cost_cmd_ = kInfinity;
     for (int i = 0; i < kNumCommandPrefixes; ++i) {
       min_cost_cmd_ = std::min(min_cost_cmd_, cost_cmd_[i]);
     }
 
-    literal_costs_.resize(num_bytes + 1);
     literal_costs_[0] = 0.0;
     for (int i = 0; i < num_bytes; ++i) {
       literal_costs_[i + 1] = literal_costs_[i] +
@@ -80,7 +84,6 @@ class ZopfliCostModel {
                            size_t position,
                            const float* literal_cost,
                            size_t literal_cost_mask) {
-    literal_costs_.resize(num_bytes + 1);
     literal_costs_[0] = 0.0;
     if (literal_cost) {
       for (int i = 0; i < num_bytes; ++i) {
@@ -92,8 +95,6 @@ class ZopfliCostModel {
         literal_costs_[i] = i * 5.4;
       }
     }
-    cost_cmd_.resize(kNumCommandPrefixes);
-    cost_dist_.resize(kNumDistancePrefixes);
     for (int i = 0; i < kNumCommandPrefixes; ++i) {
       cost_cmd_[i] = FastLog2(11 + i);
     }
@@ -103,21 +104,35 @@ class ZopfliCostModel {
     min_cost_cmd_ = FastLog2(11);
   }
 
-  double GetCommandCost(
-      int dist_code, int length_code, int insert_length) const {
-    int inscode = GetInsertLengthCode(insert_length);
-    int copycode = GetCopyLengthCode(length_code);
-    uint16_t cmdcode = CombineLengthCodes(inscode, copycode, dist_code);
-    uint64_t insnumextra = insextra[inscode];
-    uint64_t copynumextra = copyextra[copycode];
+  // The parts of the cost of the commands with a given distance code and
+  // insert length that do not depend on their copy length. The zopflification
+  // tries many copy lengths for each of them.
+  struct CommandCostBase {
+    int dist_code;
+    int inscode;
+    uint32_t numextra;
+    double dist_cost;
+  };
+
+  CommandCostBase GetCommandCostBase(int dist_code, int insert_length) const {
+    CommandCostBase base;
+    base.dist_code = dist_code;
+    base.inscode = GetInsertLengthCode(insert_length);
     uint16_t dist_symbol;
     uint32_t distextra;
     PrefixEncodeCopyDistance(dist_code, 0, 0, &dist_symbol, &distextra);
-    uint32_t distnumextra = distextra >> 24;
+    base.numextra = insextra[base.inscode] + (distextra >> 24);
+    base.dist_cost = cost_dist_[dist_symbol];
+    return base;
+  }
 
-    double result = insnumextra + copynumextra + distnumextra;
+  double GetCommandCost(const CommandCostBase& base, int length_code) const {
+    int copycode = GetCopyLengthCode(length_code);
+    uint16_t cmdcode = CombineLengthCodes(base.inscode, copycode,
+                                          base.dist_code);
+    double result = base.numextra + copyextra[copycode];
     result += cost_cmd_[cmdcode];
-    if (cmdcode >= 128) result += cost_dist_[dist_symbol];
+    if (cmdcode >= 128) result += base.dist_cost;
     return result;
   }
 
@@ -129,48 +144,55 @@ class ZopfliCostModel {
     return min_cost_cmd_;
   }
 
+  // Returns the cost of the commands for the num_bytes bytes at the position
+  // that the model was set for and of the literals after them. The commands
+  // start with the last_insert_len literals before that position, which are
+  // not counted.
+  double GetCommandsCost(size_t num_bytes, const Command* commands,
+                         int num_commands, int last_insert_len) const {
+    double cost = literal_costs_[num_bytes];
+    int pos = -last_insert_len;
+    for (int i = 0; i < num_commands; ++i) {
+      const Command& cmd = commands[i];
+      pos += cmd.insert_len_;
+      cost -= GetLiteralCosts(pos, pos + cmd.copy_len_);
+      pos += cmd.copy_len_;
+      cost += cost_cmd_[cmd.cmd_prefix_] + (cmd.cmd_extra_ >> 48);
+      if (cmd.cmd_prefix_ >= 128) {
+        cost += cost_dist_[cmd.dist_prefix_] + (cmd.dist_extra_ >> 24);
+      }
+    }
+    return cost;
+  }
+
  private:
-  void Set(const std::vector<int>& histogram, std::vector<double>* cost) {
-    cost->resize(histogram.size());
+  void Set(const int* histogram, int size, double* cost) {
     int sum = 0;
-    for (size_t i = 0; i < histogram.size(); i++) {
+    for (int i = 0; i < size; i++) {
       sum += histogram[i];
     }
     double log2sum = FastLog2(sum);
-    for (size_t i = 0; i < histogram.size(); i++) {
+    for (int i = 0; i < size; i++) {
       if (histogram[i] == 0) {
-        (*cost)[i] = log2sum + 2;
+        cost[i] = log2sum + 2;
         continue;
       }
 
       // Shannon bits for this symbol.
-      (*cost)[i] = log2sum - FastLog2(histogram[i]);
+      cost[i] = log2sum - FastLog2(histogram[i]);
 
       // Cannot be coded with less than 1 bit
-      if ((*cost)[i] < 1) (*cost)[i] = 1;
+      if (cost[i] < 1) cost[i] = 1;
     }
   }
 
-  std::vector<double> cost_cmd_;  // The insert and copy length symbols.
-  std::vector<double> cost_dist_;
+  double cost_cmd_[kNumCommandPrefixes];  // The insert and copy length symbols.
+  double cost_dist_[kNumDistancePrefixes];
   // Cumulative costs of literals per position in the stream.
-  std::vector<double> literal_costs_;
+  double* literal_costs_;
   double min_cost_cmd_;
 };
 
-inline void SetDistanceCache(int distance,
-                             int distance_code,
-                             int max_distance,
-                             const int* dist_cache,
-                             int* result_dist_cache) {
-  if (distance <= max_distance && distance_code > 0) {
-    result_dist_cache[0] = distance;
-    memcpy(&result_dist_cache[1], dist_cache, 3 * sizeof(dist_cache[0]));
-  } else {
-    memcpy(result_dist_cache, dist_cache, 4 * sizeof(dist_cache[0]));
-  }
-}
-
 inline int ComputeDistanceCode(int distance,
                                int max_distance,
                                int quality,
@@ -201,44 +223,132 @@ inline int ComputeDistanceCode(int distance,
   return distance + 15;
 }
 
+// The matches found for the zopflification are kept in 32 bits each, which
+// halves the memory that the iterations have to go through. A match in the
+// static dictionary has the top bit set, followed by 6 bits of length, 5 bits
+// of length code (0 if it is the same as the length) and 18 bits of word id,
+// which give back the distance together with the maximum distance at the
+// position of the match. Any other match has 7 bits of length and 24 bits of
+// distance, enough for the largest window. Lengths of kMaxPackedMatchLen or
+// more are stored as kMaxPackedMatchLen, and are measured again when the
+// match is unpacked; matches this long are rare.
+static const int kMaxPackedMatchLen = 127;
+static const uint32_t kPackedDictionaryMatch = 1u << 31;
+
+inline uint32_t PackMatch(const BackwardMatch& match, size_t max_distance) {
+  if (match.distance > max_distance) {
+    const uint32_t word_id = match.distance - max_distance - 1;
+    return kPackedDictionaryMatch | (match.length() << 23) |
+        ((match.length_and_code & 31) << 18) | word_id;
+  }
+  return (std::min(match.length(), kMaxPackedMatchLen) << 24) |
+      match.distance;
+}
+
+inline BackwardMatch UnpackMatch(uint32_t packed,
+                                 const uint8_t* ringbuffer,
+                                 size_t ringbuffer_mask,
+                                 size_t cur_ix,
+                                 size_t max_distance,
+                                 int max_length) {
+  if (packed & kPackedDictionaryMatch) {
+    return BackwardMatch(max_distance + (packed & 0x3ffff) + 1,
+                         (packed >> 23) & 63, (packed >> 18) & 31);
+  }
+  const int distance = packed & 0xffffff;
+  int length = packed >> 24;
+  if (length == kMaxPackedMatchLen) {
+    length = FindMatchLengthWithLimit(
+        &ringbuffer[(cur_ix - distance) & ringbuffer_mask],
+        &ringbuffer[cur_ix & ringbuffer_mask], max_length);
+  }
+  return BackwardMatch(distance, length);
+}
+
+// The nodes are kept small, since the iterations go through one of them for
+// every byte of the meta-block. The distance cache at a node is not stored,
+// but found again from the commands on the path to it, see
+// ComputeDistanceCache().
 struct ZopfliNode {
   ZopfliNode() : length(1),
                  distance(0),
-                 distance_code(0),
-                 length_code(0),
-                 insert_length(0),
+                 dcode_insert_length(0),
+                 shortcut(0),
                  cost(kInfinity) {}
 
   // best length to get up to this byte (not including this byte itself)
-  int length;
-  // distance associated with the length
-  int distance;
-  int distance_code;
-  int distance_cache[4];
+  int copy_length() const {
+    return length & 0x1ffffff;
+  }
   // length code associated with the length - usually the same as length,
   // except in case of length-changing dictionary transformation.
-  int length_code;
+  int length_code() const {
+    return copy_length() + 9 - (length >> 25);
+  }
   // number of literal inserts before this copy
-  int insert_length;
+  int insert_length() const {
+    return dcode_insert_length & 0x7ffffff;
+  }
+  int distance_code() const {
+    const int short_code = dcode_insert_length >> 27;
+    return short_code == 0 ? distance + 15 : short_code - 1;
+  }
+
+  // Copy length in the low 25 bits, and its difference to the length code
+  // plus 9 in the high 7 bits.
+  uint32_t length;
+  // distance associated with the length
+  int distance;
+  // Insert length in the low 27 bits, and in the high 5 bits the distance
+  // short code plus 1, or 0 if the distance is not coded with a short code.
+  uint32_t dcode_insert_length;
+  // The last node on the path to this node (including this node) whose
+  // command puts its distance into the distance cache, or 0 if there is none.
+  uint32_t shortcut;
   // smallest cost to get to this byte from the beginning, as found so far
   double cost;
 };
 
 inline void UpdateZopfliNode(ZopfliNode* nodes, size_t pos, size_t start_pos,
                              int len, int len_code, int dist, int dist_code,
-                             int max_dist, const int* dist_cache,
-                             double cost) {
+                             int max_dist, double cost) {
   ZopfliNode& next = nodes[pos + len];
-  next.length = len;
-  next.length_code = len_code;
+  next.length = len | ((len + 9u - len_code) << 25);
   next.distance = dist;
-  next.distance_code = dist_code;
-  next.insert_length = pos - start_pos;
+  next.dcode_insert_length = (pos - start_pos) |
+      (dist_code < kNumDistanceShortCodes ? (dist_code + 1u) << 27 : 0);
+  next.shortcut = dist <= max_dist && dist_code > 0 ?
+      pos + len : nodes[start_pos].shortcut;
   next.cost = cost;
-  SetDistanceCache(dist, dist_code, max_dist, dist_cache,
-                   &next.distance_cache[0]);
 }
 
+// Fills in the distance cache at the given position from the last distances
+// of the commands on the path to it, and from the distance cache at the start
+// of the meta-block.
+inline void ComputeDistanceCache(const ZopfliNode* nodes,
+                                 size_t pos,
+                                 const int* starting_dist_cache,
+                                 int* dist_cache) {
+  int idx = 0;
+  size_t p = nodes[pos].shortcut;
+  while (idx < 4 && p > 0) {
+    dist_cache[idx++] = nodes[p].distance;
+    p = nodes[p - nodes[p].copy_length() - nodes[p].insert_length()].shortcut;
+  }
+  for (; idx < 4; ++idx) {
+    dist_cache[idx] = *starting_dist_cache++;
+  }
+}
+
+// A position where a command can start, with the difference between the cost
+// of getting there and the cost of the literals up to there, and the distance
+// cache at that position.
+struct StartPos {
+  size_t pos;
+  double costdiff;
+  int distance_cache[4];
+};
+
 // Maintains the smallest 2^k cost difference together with their positions
 class StartPosQueue {
  public:
@@ -249,51 +359,47 @@ class StartPosQueue {
     idx_ = 0;
   }
 
-  void Push(size_t pos, double costdiff) {
-    if (costdiff == kInfinity) {
-      // We can't start a command from an unreachable start position.
-      // E.g. position 1 in a stream is always unreachable, because all commands
-      // have a copy of at least length 2.
-      return;
-    }
-    q_[idx_ & mask_] = std::make_pair(pos, costdiff);
-    // Restore the sorted order.
-    for (int i = idx_; i > 0 && i > idx_ - mask_; --i) {
-      if (q_[i & mask_].second > q_[(i - 1) & mask_].second) {
-        std::swap(q_[i & mask_], q_[(i - 1) & mask_]);
-      }
+  void Push(const StartPos& start) {
+    // The other entries are already sorted, so the new one is inserted after
+    // those with a smaller cost difference. This drops the oldest entry.
+    int i = idx_;
+    for (; i > 0 && i > idx_ - mask_ &&
+             start.costdiff > q_[(i - 1) & mask_].costdiff; --i) {
+      q_[i & mask_] = q_[(i - 1) & mask_];
     }
+    q_[i & mask_] = start;
     ++idx_;
   }
 
   int size() const { return std::min<int>(idx_, mask_ + 1); }
 
-  size_t GetStartPos(int k) const {
-    return q_[(idx_ - k - 1) & mask_].first;
+  const StartPos& GetStartPos(int k) const {
+    return q_[(idx_ - k - 1) & mask_];
   }
 
  private:
   const int mask_;
-  std::vector<std::pair<size_t, double> > q_;
+  std::vector<StartPos> q_;
   int idx_;
 };
 
 // Returns the minimum possible copy length that can improve the cost of any
 // future position.
 int ComputeMinimumCopyLength(const StartPosQueue& queue,
-                             const std::vector<ZopfliNode>& nodes,
+                             const ZopfliNode* nodes,
+                             size_t num_nodes,
                              const ZopfliCostModel& model,
                              size_t pos,
                              double min_cost_cmd) {
   // Compute the minimum possible cost of reaching any future position.
-  const size_t start0 = queue.GetStartPos(0);
+  const size_t start0 = queue.GetStartPos(0).pos;
   double min_cost = (nodes[start0].cost +
                      model.GetLiteralCosts(start0, pos) +
                      min_cost_cmd);
   int len = 2;
   int next_len_bucket = 4;
   int next_len_offset = 10;
-  while (pos + len < nodes.size() && nodes[pos + len].cost <= min_cost) {
+  while (pos + len < num_nodes && nodes[pos + len].cost <= min_cost) {
     // We already reached (pos + len) with no more cost than the minimum
     // possible cost of reaching anything from this pos, so there is no point in
     // looking for lengths <= len.
@@ -309,14 +415,60 @@ int ComputeMinimumCopyLength(const StartPosQueue& queue,
   return len;
 }
 
+// Sets lens[j] to the length of the match at the distance of short distance
+// code j at cur_ix, if it is longer than best_len and the matches of the codes
+// before it, and to 0 otherwise.
+inline void FindLastDistanceMatches(const uint8_t* ringbuffer,
+                                    size_t ringbuffer_mask,
+                                    size_t cur_ix,
+                                    size_t first_position,
+                                    size_t max_distance,
+                                    int max_length,
+                                    const int* dist_cache,
+                                    int best_len,
+                                    int* lens) {
+  const size_t cur_ix_masked = cur_ix & ringbuffer_mask;
+  for (int j = 0; j < kNumDistanceShortCodes; ++j) {
+    lens[j] = 0;
+    const int idx = kDistanceCacheIndex[j];
+    const int backward = dist_cache[idx] + kDistanceCacheOffset[j];
+    size_t prev_ix = cur_ix - backward;
+    if (prev_ix >= cur_ix || prev_ix < first_position) {
+      continue;
+    }
+    if (PREDICT_FALSE(backward > max_distance)) {
+      continue;
+    }
+    prev_ix &= ringbuffer_mask;
+
+    if (cur_ix_masked + best_len > ringbuffer_mask ||
+        prev_ix + best_len > ringbuffer_mask ||
+        ringbuffer[cur_ix_masked + best_len] !=
+        ringbuffer[prev_ix + best_len]) {
+      continue;
+    }
+    const int len = FindMatchLengthWithLimit(&ringbuffer[prev_ix],
+                                             &ringbuffer[cur_ix_masked],
+                                             max_length);
+    if (len > best_len) {
+      lens[j] = len;
+      best_len = len;
+    }
+  }
+}
+
+// Finds the cheapest commands for the data under the cost model.
 void ZopfliIterate(size_t num_bytes,
                    size_t position,
                    const uint8_t* ringbuffer,
                    size_t ringbuffer_mask,
                    const size_t max_backward_limit,
+                   const size_t first_position,
                    const ZopfliCostModel& model,
-                   const std::vector<int>& num_matches,
-                   const std::vector<BackwardMatch>& matches,
+                   const int* num_matches,
+                   const uint32_t* matches,
+                   ZopfliNode* nodes,
+                   int* path,
                    int* dist_cache,
                    int* last_insert_len,
                    Command* commands,
@@ -324,65 +476,84 @@ void ZopfliIterate(size_t num_bytes,
                    int* num_literals) {
   const Command * const orig_commands = commands;
 
-  std::vector<ZopfliNode> nodes(num_bytes + 1);
+  for (size_t i = 0; i <= num_bytes; ++i) {
+    new (&nodes[i]) ZopfliNode;
+  }
   nodes[0].length = 0;
   nodes[0].cost = 0;
-  memcpy(nodes[0].distance_cache, dist_cache, 4 * sizeof(dist_cache[0]));
 
   StartPosQueue queue(3);
   const double min_cost_cmd = model.GetMinCostCmd();
 
+  BackwardMatch cur_matches[kMaxZopfliLen];
+  int last_distance_lens[5][kNumDistanceShortCodes];
   size_t cur_match_pos = 0;
   for (size_t i = 0; i + 3 < num_bytes; i++) {
     size_t cur_ix = position + i;
-    size_t cur_ix_masked = cur_ix & ringbuffer_mask;
     size_t max_distance = std::min(cur_ix, max_backward_limit);
     int max_length = num_bytes - i;
+    for (int j = 0; j < num_matches[i]; ++j) {
+      cur_matches[j] = UnpackMatch(matches[cur_match_pos + j],
+                                   ringbuffer, ringbuffer_mask,
+                                   cur_ix, max_distance, max_length);
+    }
+    cur_match_pos += num_matches[i];
 
-    queue.Push(i, nodes[i].cost - model.GetLiteralCosts(0, i));
+    // We can't start a command from an unreachable start position.
+    // E.g. position 1 in a stream is always unreachable, because all commands
+    // have a copy of at least length 2.
+    if (nodes[i].cost != kInfinity) {
+      StartPos start_pos;
+      start_pos.pos = i;
+      start_pos.costdiff = nodes[i].cost - model.GetLiteralCosts(0, i);
+      ComputeDistanceCache(nodes, i, dist_cache, start_pos.distance_cache);
+      queue.Push(start_pos);
+    }
 
-    const int min_len = ComputeMinimumCopyLength(queue, nodes, model,
-                                                 i, min_cost_cmd);
+    const int min_len = ComputeMinimumCopyLength(queue, nodes, num_bytes + 1,
+                                                 model, i, min_cost_cmd);
 
     // Go over the command starting positions in order of increasing cost
     // difference.
     for (size_t k = 0; k < 5 && k < queue.size(); ++k) {
-      const size_t start = queue.GetStartPos(k);
-      const double start_costdiff =
-          nodes[start].cost - model.GetLiteralCosts(0, start);
-      const int* dist_cache2 = &nodes[start].distance_cache[0];
+      const StartPos& start_pos = queue.GetStartPos(k);
+      const size_t start = start_pos.pos;
+      const double start_costdiff = start_pos.costdiff;
+      const int* dist_cache2 = &start_pos.distance_cache[0];
 
       // Look for last distance matches using the distance cache from this
-      // starting position.
+      // starting position. The starting positions often have the same
+      // distance cache, and then also the same matches, which are looked up
+      // only for the first of them.
+      int* short_code_lens = &last_distance_lens[k][0];
+      for (size_t k2 = 0; k2 < k; ++k2) {
+        if (memcmp(queue.GetStartPos(k2).distance_cache, dist_cache2,
+                   sizeof(start_pos.distance_cache)) == 0) {
+          short_code_lens = &last_distance_lens[k2][0];
+          break;
+        }
+      }
+      if (short_code_lens == &last_distance_lens[k][0]) {
+        FindLastDistanceMatches(ringbuffer, ringbuffer_mask, cur_ix,
+                                first_position, max_distance, max_length,
+                                dist_cache2, min_len - 1, short_code_lens);
+      }
       int best_len = min_len - 1;
       for (int j = 0; j < kNumDistanceShortCodes; ++j) {
-        const int idx = kDistanceCacheIndex[j];
-        const int backward = dist_cache2[idx] + kDistanceCacheOffset[j];
-        size_t prev_ix = cur_ix - backward;
-        if (prev_ix >= cur_ix) {
-          continue;
-        }
-        if (PREDICT_FALSE(backward > max_distance)) {
-          continue;
-        }
-        prev_ix &= ringbuffer_mask;
-
-        if (cur_ix_masked + best_len > ringbuffer_mask ||
-            prev_ix + best_len > ringbuffer_mask ||
-            ringbuffer[cur_ix_masked + best_len] !=
-            ringbuffer[prev_ix + best_len]) {
+        const int len = short_code_lens[j];
+        if (len <= best_len) {
           continue;
         }
-        const size_t len =
-            FindMatchLengthWithLimit(&ringbuffer[prev_ix],
-                                     &ringbuffer[cur_ix_masked],
-                                     max_length);
+        const int backward =
+            dist_cache2[kDistanceCacheIndex[j]] + kDistanceCacheOffset[j];
+        const ZopfliCostModel::CommandCostBase base =
+            model.GetCommandCostBase(j, i - start);
         for (int l = best_len + 1; l <= len; ++l) {
-          double cmd_cost = model.GetCommandCost(j, l, i - start);
+          double cmd_cost = model.GetCommandCost(base, l);
           double cost = start_costdiff + cmd_cost + model.GetLiteralCosts(0, i);
           if (cost < nodes[i + l].cost) {
             UpdateZopfliNode(&nodes[0], i, start, l, l, backward, j,
-                             max_distance, dist_cache2, cost);
+                             max_distance, cost);
           }
           best_len = l;
         }
@@ -396,7 +567,7 @@ void ZopfliIterate(size_t num_bytes,
       // Loop through all possible copy lengths at this position.
       int len = min_len;
       for (int j = 0; j < num_matches[i]; ++j) {
-        BackwardMatch match = matches[cur_match_pos + j];
+        const BackwardMatch& match = cur_matches[j];
         int dist = match.distance;
         bool is_dictionary_match = dist > max_distance;
         // We already tried all possible last distance matches, so we can use
@@ -409,59 +580,54 @@ void ZopfliIterate(size_t num_bytes,
         if (len < max_len && (is_dictionary_match || max_len > kMaxZopfliLen)) {
           len = max_len;
         }
+        if (len > max_len) continue;
+        const ZopfliCostModel::CommandCostBase base =
+            model.GetCommandCostBase(dist_code, i - start);
         for (; len <= max_len; ++len) {
           int len_code = is_dictionary_match ? match.length_code() : len;
-          double cmd_cost =
-              model.GetCommandCost(dist_code, len_code, i - start);
+          double cmd_cost = model.GetCommandCost(base, len_code);
           double cost = start_costdiff + cmd_cost + model.GetLiteralCosts(0, i);
           if (cost < nodes[i + len].cost) {
             UpdateZopfliNode(&nodes[0], i, start, len, len_code, dist,
-                             dist_code, max_distance, dist_cache2, cost);
+                             dist_code, max_distance, cost);
           }
         }
       }
     }
 
-    cur_match_pos += num_matches[i];
-
     // The zopflification can be too slow in case of very long lengths, so in
     // such case skip it all, it does not cost a lot of compression ratio.
-    if (num_matches[i] == 1 &&
-        matches[cur_match_pos - 1].length() > kMaxZopfliLen) {
-      i += matches[cur_match_pos - 1].length() - 1;
+    if (num_matches[i] == 1 && cur_matches[0].length() > kMaxZopfliLen) {
+      i += cur_matches[0].length() - 1;
       queue.Clear();
     }
   }
 
-  std::vector<int> backwards;
+  // The path is built backwards from its end at path[num_bytes].
+  size_t path_start = num_bytes + 1;
   size_t index = num_bytes;
   while (nodes[index].cost == kInfinity) --index;
   while (index > 0) {
-    int len = nodes[index].length + nodes[index].insert_length;
-    backwards.push_back(len);
+    int len = nodes[index].copy_length() + nodes[index].insert_length();
+    path[--path_start] = len;
     index -= len;
   }
 
-  std::vector<int> path;
-  for (size_t i = backwards.size(); i > 0; i--) {
-    path.push_back(backwards[i - 1]);
-  }
-
   size_t pos = 0;
-  for (size_t i = 0; i < path.size(); i++) {
+  for (size_t i = path_start; i <= num_bytes; i++) {
     const ZopfliNode& next = nodes[pos + path[i]];
-    int copy_length = next.length;
-    int insert_length = next.insert_length;
+    int copy_length = next.copy_length();
+    int insert_length = next.insert_length();
     pos += insert_length;
-    if (i == 0) {
+    if (i == path_start) {
       insert_length += *last_insert_len;
       *last_insert_len = 0;
     }
     int distance = next.distance;
-    int len_code = next.length_code;
+    int len_code = next.length_code();
     size_t max_distance = std::min(position + pos, max_backward_limit);
     bool is_dictionary = (distance > max_distance);
-    int dist_code = next.distance_code;
+    int dist_code = next.distance_code();
 
     Command cmd(insert_length, copy_length, len_code, dist_code);
     *commands++ = cmd;
@@ -494,7 +660,7 @@ void CreateBackwardReferences(size_t num_bytes,
                               Command* commands,
                               int* num_commands,
                               int* num_literals) {
-  if (num_bytes >= 3 && position >= 3) {
+  if (num_bytes >= 3 && position >= hasher->first_position() + 3) {
     // Prepare the hashes for three last bytes of the last write.
     // These could not be calculated before, since they require knowledge
     // of both the previous and the current block.
@@ -619,7 +785,142 @@ void CreateBackwardReferences(size_t num_bytes,
   *num_commands += (commands - orig_commands);
 }
 
-void CreateBackwardReferences(size_t num_bytes,
+bool CreateZopfliBackwardReferences(size_t num_bytes,
+                                    size_t position,
+                                    const uint8_t* ringbuffer,
+                                    size_t ringbuffer_mask,
+                                    const float* literal_cost,
+                                    size_t literal_cost_mask,
+                                    const size_t max_backward_limit,
+                                    int num_iterations,
+                                    Hashers::H10* hasher,
+                                    MemoryArena* arena,
+                                    int* dist_cache,
+                                    int* last_insert_len,
+                                    Command* commands,
+                                    int* num_commands,
+                                    int* num_literals) {
+  hasher->StitchToPreviousBlock(num_bytes, position, ringbuffer,
+                                ringbuffer_mask);
+  int* num_matches = arena->Allocate<int>(num_bytes);
+  size_t matches_size = 3 * num_bytes;
+  uint32_t* matches = arena->Allocate<uint32_t>(matches_size);
+  ZopfliNode* nodes = arena->Allocate<ZopfliNode>(num_bytes + 1);
+  int* path = arena->Allocate<int>(num_bytes + 1);
+  double* literal_costs = arena->Allocate<double>(num_bytes + 1);
+  if (num_matches == NULL || matches == NULL || nodes == NULL ||
+      path == NULL || literal_costs == NULL) {
+    return false;
+  }
+  memset(num_matches, 0, num_bytes * sizeof(num_matches[0]));
+  // FindAllMatches() inserts the positions into the trees, except for the
+  // last ones, which are inserted with the next block.
+  const size_t store_end = num_bytes >= Hashers::H10::kMaxTreeCompLength ?
+      num_bytes - Hashers::H10::kMaxTreeCompLength + 1 : 0;
+  BackwardMatch cur_matches[kMaxZopfliLen];
+  size_t cur_match_pos = 0;
+  for (size_t i = 0; i + 3 < num_bytes; ++i) {
+    size_t max_distance = std::min(position + i, max_backward_limit);
+    int max_length = num_bytes - i;
+    hasher->FindAllMatches(
+        ringbuffer, ringbuffer_mask,
+        position + i, max_length, max_distance,
+        &num_matches[i], cur_matches);
+    if (matches_size < cur_match_pos + num_matches[i]) {
+      // The old array is released with the rest of the arena.
+      uint32_t* new_matches = arena->Allocate<uint32_t>(2 * matches_size);
+      if (new_matches == NULL) {
+        return false;
+      }
+      memcpy(new_matches, matches, cur_match_pos * sizeof(matches[0]));
+      matches = new_matches;
+      matches_size *= 2;
+    }
+    for (int j = 0; j < num_matches[i]; ++j) {
+      matches[cur_match_pos++] = PackMatch(cur_matches[j], max_distance);
+    }
+    if (num_matches[i] == 1) {
+      const int match_len = cur_matches[0].length();
+      if (match_len > kMaxZopfliLen) {
+        hasher->StoreRange(ringbuffer, ringbuffer_mask, position + i + 1,
+                           position + std::min(i + match_len, store_end));
+        i += match_len - 1;
+      }
+    }
+  }
+  int orig_num_literals = *num_literals;
+  int orig_last_insert_len = *last_insert_len;
+  int orig_dist_cache[4] = {
+    dist_cache[0], dist_cache[1], dist_cache[2], dist_cache[3]
+  };
+  int orig_num_commands = *num_commands;
+  ZopfliCostModel model(literal_costs);
+  model.SetFromLiteralCosts(num_bytes, position,
+                            literal_cost, literal_cost_mask);
+  double last_cost = kInfinity;
+  // The commands of the previous pass, which are restored if this pass turns
+  // out to be more expensive.
+  Command* saved_commands = NULL;
+  int saved_commands_size = 0;
+  int saved_num_commands = 0;
+  int saved_num_literals = 0;
+  int saved_last_insert_len = 0;
+  int saved_dist_cache[4];
+  for (int i = 0; i < num_iterations; i++) {
+    *num_commands = orig_num_commands;
+    *num_literals = orig_num_literals;
+    *last_insert_len = orig_last_insert_len;
+    memcpy(dist_cache, orig_dist_cache, 4 * sizeof(dist_cache[0]));
+    ZopfliIterate(num_bytes, position, ringbuffer, ringbuffer_mask,
+                  max_backward_limit, hasher->first_position(), model,
+                  num_matches, matches, nodes, path,
+                  dist_cache, last_insert_len, commands, num_commands,
+                  num_literals);
+    const int pass_num_commands = *num_commands - orig_num_commands;
+    // The model of the next pass is set from the commands of this one. Their
+    // cost under it estimates their entropy coded size, which can be compared
+    // between passes, unlike the costs under the models they were found with.
+    model.SetFromCommands(num_bytes, position,
+                          ringbuffer, ringbuffer_mask,
+                          commands, pass_num_commands,
+                          orig_last_insert_len);
+    const double cost = model.GetCommandsCost(num_bytes, commands,
+                                              pass_num_commands,
+                                              orig_last_insert_len);
+    // If this pass did not find cheaper commands than the previous one, the
+    // cost model has settled and more passes are unlikely to help, so the
+    // commands of the previous pass are kept.
+    if (cost >= last_cost) {
+      memcpy(commands, saved_commands,
+             saved_num_commands * sizeof(commands[0]));
+      *num_commands = orig_num_commands + saved_num_commands;
+      *num_literals = saved_num_literals;
+      *last_insert_len = saved_last_insert_len;
+      memcpy(dist_cache, saved_dist_cache, 4 * sizeof(dist_cache[0]));
+      break;
+    }
+    last_cost = cost;
+    if (i + 1 < num_iterations) {
+      saved_num_commands = pass_num_commands;
+      if (saved_commands_size < saved_num_commands) {
+        // The old array is released with the rest of the arena.
+        saved_commands_size = 2 * saved_num_commands;
+        saved_commands = arena->Allocate<Command>(saved_commands_size);
+        if (saved_commands == NULL) {
+          return false;
+        }
+      }
+      memcpy(saved_commands, commands,
+             saved_num_commands * sizeof(commands[0]));
+      saved_num_literals = *num_literals;
+      saved_last_insert_len = *last_insert_len;
+      memcpy(saved_dist_cache, dist_cache, 4 * sizeof(dist_cache[0]));
+    }
+  }
+  return true;
+}
+
+bool CreateBackwardReferences(size_t num_bytes,
                               size_t position,
                               const uint8_t* ringbuffer,
                               size_t ringbuffer_mask,
@@ -627,8 +928,10 @@ void CreateBackwardReferences(size_t num_bytes,
                               size_t literal_cost_mask,
                               const size_t max_backward_limit,
                               const int quality,
+                              int zopfli_iterations,
                               Hashers* hashers,
                               int hash_type,
+                              MemoryArena* arena,
                               int* dist_cache,
                               int* last_insert_len,
                               Command* commands,
@@ -636,74 +939,14 @@ void CreateBackwardReferences(size_t num_bytes,
                               int* num_literals) {
   bool zopflify = quality > 9;
   if (zopflify) {
-    Hashers::H9* hasher = hashers->hash_h9.get();
-    if (num_bytes >= 3 && position >= 3) {
-      // Prepare the hashes for three last bytes of the last write.
-      // These could not be calculated before, since they require knowledge
-      // of both the previous and the current block.
-      hasher->Store(&ringbuffer[(position - 3) & ringbuffer_mask],
-                    position - 3);
-      hasher->Store(&ringbuffer[(position - 2) & ringbuffer_mask],
-                    position - 2);
-      hasher->Store(&ringbuffer[(position - 1) & ringbuffer_mask],
-                    position - 1);
+    if (zopfli_iterations <= 0) {
+      zopfli_iterations = quality > 10 ? 2 : 1;
     }
-    std::vector<int> num_matches(num_bytes);
-    std::vector<BackwardMatch> matches(3 * num_bytes);
-    size_t cur_match_pos = 0;
-    for (size_t i = 0; i + 3 < num_bytes; ++i) {
-      size_t max_distance = std::min(position + i, max_backward_limit);
-      int max_length = num_bytes - i;
-      // Ensure that we have at least kMaxZopfliLen free slots.
-      if (matches.size() < cur_match_pos + kMaxZopfliLen) {
-        matches.resize(cur_match_pos + kMaxZopfliLen);
-      }
-      hasher->FindAllMatches(
-          ringbuffer, ringbuffer_mask,
-          position + i, max_length, max_distance,
-          &num_matches[i], &matches[cur_match_pos]);
-      hasher->Store(&ringbuffer[(position + i) & ringbuffer_mask],
-                    position + i);
-      cur_match_pos += num_matches[i];
-      if (num_matches[i] == 1) {
-        const int match_len = matches[cur_match_pos - 1].length();
-        if (match_len > kMaxZopfliLen) {
-          for (int j = 1; j < match_len; ++j) {
-            ++i;
-            hasher->Store(
-                &ringbuffer[(position + i) & ringbuffer_mask], position + i);
-            num_matches[i] = 0;
-          }
-        }
-      }
-    }
-    int orig_num_literals = *num_literals;
-    int orig_last_insert_len = *last_insert_len;
-    int orig_dist_cache[4] = {
-      dist_cache[0], dist_cache[1], dist_cache[2], dist_cache[3]
-    };
-    int orig_num_commands = *num_commands;
-    static const int kIterations = 2;
-    for (int i = 0; i < kIterations; i++) {
-      ZopfliCostModel model;
-      if (i == 0) {
-        model.SetFromLiteralCosts(num_bytes, position,
-                                  literal_cost, literal_cost_mask);
-      } else {
-        model.SetFromCommands(num_bytes, position,
-                              ringbuffer, ringbuffer_mask,
-                              commands, *num_commands - orig_num_commands,
-                              orig_last_insert_len);
-      }
-      *num_commands = orig_num_commands;
-      *num_literals = orig_num_literals;
-      *last_insert_len = orig_last_insert_len;
-      memcpy(dist_cache, orig_dist_cache, 4 * sizeof(dist_cache[0]));
-      ZopfliIterate(num_bytes, position, ringbuffer, ringbuffer_mask,
-                    max_backward_limit, model, num_matches, matches, dist_cache,
-                    last_insert_len, commands, num_commands, num_literals);
-    }
-    return;
+    return CreateZopfliBackwardReferences(
+        num_bytes, position, ringbuffer, ringbuffer_mask,
+        literal_cost, literal_cost_mask, max_backward_limit,
+        zopfli_iterations, hashers->hash_h10.get(), arena, dist_cache,
+        last_insert_len, commands, num_commands, num_literals);
   }
 
   switch (hash_type) {
@@ -761,9 +1004,40 @@ void CreateBackwardReferences(size_t num_bytes,
           quality, hashers->hash_h9.get(), dist_cache, last_insert_len,
           commands, num_commands, num_literals);
       break;
+    case 15:
+      CreateBackwardReferences<Hashers::H15>(
+          num_bytes, position, ringbuffer, ringbuffer_mask, max_backward_limit,
+          quality, hashers->hash_h15.get(), dist_cache, last_insert_len,
+          commands, num_commands, num_literals);
+      break;
+    case 16:
+      CreateBackwardReferences<Hashers::H16>(
+          num_bytes, position, ringbuffer, ringbuffer_mask, max_backward_limit,
+          quality, hashers->hash_h16.get(), dist_cache, last_insert_len,
+          commands, num_commands, num_literals);
+      break;
+    case 17:
+      CreateBackwardReferences<Hashers::H17>(
+          num_bytes, position, ringbuffer, ringbuffer_mask, max_backward_limit,
+          quality, hashers->hash_h17.get(), dist_cache, last_insert_len,
+          commands, num_commands, num_literals);
+      break;
+    case 18:
+      CreateBackwardReferences<Hashers::H18>(
+          num_bytes, position, ringbuffer, ringbuffer_mask, max_backward_limit,
+          quality, hashers->hash_h18.get(), dist_cache, last_insert_len,
+          commands, num_commands, num_literals);
+      break;
+    case 19:
+      CreateBackwardReferences<Hashers::H19>(
+          num_bytes, position, ringbuffer, ringbuffer_mask, max_backward_limit,
+          quality, hashers->hash_h19.get(), dist_cache, last_insert_len,
+          commands, num_commands, num_literals);
+      break;
     default:
       break;
   }
+  return true;
 }
 
 }  // namespace brotli
@@ -22,14 +22,16 @@
 
 #include "./hash.h"
 #include "./command.h"
+#include "./memory.h"
 
 namespace brotli {
 
 // "commands" points to the next output command to write to, "*num_commands" is
 // initially the total amount of commands output by previous
 // CreateBackwardReferences calls, and must be incremented by the amount written
-// by this call.
-void CreateBackwardReferences(size_t num_bytes,
+// by this call. Temporary memory is allocated from the arena, which the caller
+// resets afterwards. Returns false if the memory could not be allocated.
+bool CreateBackwardReferences(size_t num_bytes,
                               size_t position,
                               const uint8_t* ringbuffer,
                               size_t ringbuffer_mask,
@@ -37,8 +39,10 @@ void CreateBackwardReferences(size_t num_bytes,
                               size_t literal_cost_mask,
                               const size_t max_backward_limit,
                               const int quality,
+                              int zopfli_iterations,
                               Hashers* hashers,
                               int hash_type,
+                              MemoryArena* arena,
                               int* dist_cache,
                               int* last_insert_len,
                               Command* commands,
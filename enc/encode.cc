@@ -34,6 +34,7 @@
 #include "./literal_cost.h"
 #include "./prefix.h"
 #include "./write_bits.h"
+#include "../dec/seek_index.h"
 
 namespace brotli {
 
@@ -125,24 +126,19 @@ void RecomputeDistancePrefixes(Command* cmds,
 
 uint8_t* BrotliCompressor::GetBrotliStorage(size_t size) {
   if (storage_size_ < size) {
-    storage_.reset(new uint8_t[size]);
-    storage_size_ = size;
+    storage_ = AllocateArray<uint8_t>(allocator_, size);
+    storage_size_ = storage_ ? size : 0;
   }
-  return &storage_[0];
+  return storage_.get();
 }
 
 BrotliCompressor::BrotliCompressor(BrotliParams params)
     : params_(params),
-      hashers_(new Hashers()),
-      input_pos_(0),
-      num_commands_(0),
-      num_literals_(0),
-      last_insert_len_(0),
-      last_flush_pos_(0),
-      last_processed_pos_(0),
-      prev_byte_(0),
-      prev_byte2_(0),
-      storage_size_(0) {
+      allocator_(params.allocator != NULL ? params.allocator
+                                          : DefaultAllocator()),
+      hashers_(new Hashers(allocator_)),
+      storage_size_(0),
+      arena_(allocator_) {
   // Sanitize params.
   params_.quality = std::max(1, params_.quality);
   if (params_.lgwin < kMinWindowBits) {
@@ -159,6 +155,9 @@ BrotliCompressor::BrotliCompressor(BrotliParams params)
     params_.lgblock = std::min(kMaxInputBlockBits,
                                std::max(kMinInputBlockBits, params_.lgblock));
   }
+  if (params_.lgseek != 0) {
+    params_.lgseek = std::min(30, std::max(kMinInputBlockBits, params_.lgseek));
+  }
 
   // Set maximum distance, see section 9.1. of the spec.
   max_backward_distance_ = (1 << params_.lgwin) - 16;
@@ -169,15 +168,45 @@ BrotliCompressor::BrotliCompressor(BrotliParams params)
   // read_block_size_bits + 1 bits because the copy tail length needs to be
   // smaller than ringbuffer size.
   int ringbuffer_bits = std::max(params_.lgwin + 1, params_.lgblock + 1);
-  ringbuffer_.reset(new RingBuffer(ringbuffer_bits, params_.lgblock));
+  ringbuffer_.reset(new RingBuffer(ringbuffer_bits, params_.lgblock,
+                                   allocator_));
+  buffers_ok_ = ringbuffer_->start() != NULL;
   if (params_.quality > 9) {
     literal_cost_mask_ = (1 << params_.lgblock) - 1;
-    literal_cost_.reset(new float[literal_cost_mask_ + 1]);
+    literal_cost_ = AllocateArray<float>(allocator_, literal_cost_mask_ + 1);
+    buffers_ok_ = buffers_ok_ && literal_cost_;
   }
 
   // Allocate command buffer.
   cmd_buffer_size_ = std::max(1 << 18, 1 << params_.lgblock);
-  commands_.reset(new brotli::Command[cmd_buffer_size_]);
+  commands_ = AllocateArray<Command>(allocator_, cmd_buffer_size_);
+  buffers_ok_ = buffers_ok_ && commands_;
+
+  ResetState();
+}
+
+void BrotliCompressor::Reset() {
+  ringbuffer_->Reset();
+  ResetState();
+}
+
+void BrotliCompressor::ResetState() {
+  input_pos_ = 0;
+  num_commands_ = 0;
+  num_literals_ = 0;
+  last_insert_len_ = 0;
+  last_flush_pos_ = 0;
+  last_processed_pos_ = 0;
+  next_independent_pos_ =
+      params_.lgseek > 0 ? static_cast<size_t>(1) << params_.lgseek : 0;
+  at_independent_meta_block_ = false;
+  prev_byte_ = 0;
+  prev_byte2_ = 0;
+  // The hashers are allocated and prepared when the first input block is
+  // processed, since a smaller hasher can be used and it can be cleared
+  // faster if the whole input is known at that time.
+  hash_type_ = Hashers::HasherTypeForQuality(params_.quality);
+  hashers_ready_ = false;
 
   // Initialize last byte with stream header.
   if (params_.lgwin == 16) {
@@ -202,10 +231,6 @@ BrotliCompressor::BrotliCompressor(BrotliParams params)
   // Save the state of the distance cache in case we need to restore it for
   // emitting an uncompressed block.
   memcpy(saved_dist_cache_, dist_cache_, sizeof(dist_cache_));
-
-  // Initialize hashers.
-  hash_type_ = std::min(9, params_.quality);
-  hashers_->Init(hash_type_);
 }
 
 BrotliCompressor::~BrotliCompressor() {
@@ -213,6 +238,10 @@ BrotliCompressor::~BrotliCompressor() {
 
 void BrotliCompressor::CopyInputToRingBuffer(const size_t input_size,
                                              const uint8_t* input_buffer) {
+  if (!buffers_ok_) {
+    // The data is dropped, the next WriteBrotliData() fails anyway.
+    return;
+  }
   ringbuffer_->Write(input_buffer, input_size);
   input_pos_ += input_size;
 
@@ -273,6 +302,15 @@ void BrotliCompressor::BrotliSetCustomDictionary(
   if (size > 1) {
     prev_byte2_ = dict[size - 2];
   }
+  if (!hashers_ready_) {
+    if (!buffers_ok_ || !hashers_->Init(hash_type_, params_.lgwin)) {
+      // The compressor can not be used, see WriteBrotliData().
+      buffers_ok_ = false;
+      return;
+    }
+    hashers_->Prepare(hash_type_, false, 0, NULL);
+    hashers_ready_ = true;
+  }
   hashers_->PrependCustomDictionary(hash_type_, size, dict);
 }
 
@@ -283,8 +321,11 @@ bool BrotliCompressor::WriteBrotliData(const bool is_last,
   const size_t bytes = input_pos_ - last_processed_pos_;
   const uint8_t* data = ringbuffer_->start();
   const size_t mask = ringbuffer_->mask();
+  const bool independent =
+      params_.lgseek > 0 && !is_last && input_pos_ >= next_independent_pos_;
+  at_independent_meta_block_ = false;
 
-  if (bytes > input_block_size()) {
+  if (!buffers_ok_ || bytes > input_block_size()) {
     return false;
   }
 
@@ -303,24 +344,39 @@ bool BrotliCompressor::WriteBrotliData(const bool is_last,
                                   data, literal_cost_.get());
     }
   }
-  CreateBackwardReferences(bytes, last_processed_pos_, data, mask,
-                           literal_cost_.get(),
-                           literal_cost_mask_,
-                           max_backward_distance_,
-                           params_.quality,
-                           hashers_.get(),
-                           hash_type_,
-                           dist_cache_,
-                           &last_insert_len_,
-                           &commands_[num_commands_],
-                           &num_commands_,
-                           &num_literals_);
+  if (!hashers_ready_) {
+    // This is the first block of the stream, so if it is also the last one,
+    // it is the whole input starting at the beginning of the ring buffer.
+    hash_type_ = Hashers::HasherTypeForInput(hash_type_, is_last, bytes);
+    if (!hashers_->Init(hash_type_, params_.lgwin, is_last, bytes)) {
+      return false;
+    }
+    hashers_->Prepare(hash_type_, is_last, bytes, data);
+    hashers_ready_ = true;
+  }
+  arena_.Reset();
+  if (!CreateBackwardReferences(bytes, last_processed_pos_, data, mask,
+                                literal_cost_.get(),
+                                literal_cost_mask_,
+                                max_backward_distance_,
+                                params_.quality,
+                                params_.zopfli_iterations,
+                                hashers_.get(),
+                                hash_type_,
+                                &arena_,
+                                dist_cache_,
+                                &last_insert_len_,
+                                &commands_[num_commands_],
+                                &num_commands_,
+                                &num_literals_)) {
+    return false;
+  }
 
   // For quality 1 there is no block splitting, so we buffer at most this much
   // literals and commands.
   static const int kMaxNumDelayedSymbols = 0x2fff;
   int max_length = std::min<int>(mask + 1, 1 << kMaxInputBlockBits);
-  if (!is_last && !force_flush &&
+  if (!is_last && !force_flush && !independent &&
       (params_.quality >= kMinQualityForBlockSplit ||
        (num_literals_ + num_commands_ < kMaxNumDelayedSymbols)) &&
       num_commands_ + (input_block_size() >> 1) < cmd_buffer_size_ &&
@@ -339,7 +395,19 @@ bool BrotliCompressor::WriteBrotliData(const bool is_last,
     last_insert_len_ = 0;
   }
 
-  return WriteMetaBlockInternal(is_last, utf8_mode, out_size, output);
+  if (!WriteMetaBlockInternal(is_last, utf8_mode, out_size, output)) {
+    return false;
+  }
+  if (independent) {
+    // The partial last byte of the output is still in the storage.
+    int storage_ix = static_cast<int>(*out_size * 8) + last_byte_bits_;
+    StartIndependentMetaBlockInternal(&storage_ix, *output);
+    *out_size = storage_ix >> 3;
+    next_independent_pos_ =
+        ((input_pos_ >> params_.lgseek) + 1) << params_.lgseek;
+    at_independent_meta_block_ = true;
+  }
+  return true;
 }
 
 // Decide about the context map based on the ability of the prediction
@@ -447,6 +515,9 @@ bool BrotliCompressor::WriteMetaBlockInternal(const bool is_last,
   const size_t mask = ringbuffer_->mask();
   const size_t max_out_size = 2 * bytes + 500;
   uint8_t* storage = GetBrotliStorage(max_out_size);
+  if (storage == NULL) {
+    return false;
+  }
   storage[0] = last_byte_;
   int storage_ix = last_byte_bits_;
 
@@ -627,6 +698,41 @@ bool BrotliCompressor::WriteMetadata(const size_t input_size,
   return true;
 }
 
+bool BrotliCompressor::StartIndependentMetaBlock(size_t* encoded_size,
+                                                 uint8_t* encoded_buffer) {
+  if (!buffers_ok_ || last_flush_pos_ != input_pos_ ||
+      (last_byte_bits_ != 0 && *encoded_size < 2)) {
+    return false;
+  }
+  uint8_t storage[16];
+  storage[0] = last_byte_;
+  int storage_ix = last_byte_bits_;
+  StartIndependentMetaBlockInternal(&storage_ix, storage);
+  *encoded_size = storage_ix >> 3;
+  memcpy(encoded_buffer, storage, *encoded_size);
+  return true;
+}
+
+void BrotliCompressor::StartIndependentMetaBlockInternal(int* storage_ix,
+                                                         uint8_t* storage) {
+  if ((*storage_ix & 7) != 0) {
+    // An empty metadata meta-block moves the stream to a byte boundary.
+    StoreSyncMetaBlock(storage_ix, storage);
+  }
+  last_byte_ = 0;
+  last_byte_bits_ = 0;
+  // Forget the positions before, so that no backward reference reaches them.
+  if (hashers_ready_) {
+    hashers_->ResetAt(hash_type_, input_pos_);
+  }
+  // The distance cache entries of the decoder are unknown at this point, so
+  // they are replaced by distances that never match.
+  for (int i = 0; i < 4; ++i) {
+    dist_cache_[i] = -4;
+  }
+  memcpy(saved_dist_cache_, dist_cache_, sizeof(dist_cache_));
+}
+
 bool BrotliCompressor::FinishStream(
     size_t* encoded_size, uint8_t* encoded_buffer) {
   return WriteMetaBlock(0, NULL, true, encoded_size, encoded_buffer);
@@ -641,7 +747,6 @@ int BrotliCompressBuffer(BrotliParams params,
     // Output buffer needs at least one byte.
     return 0;
   }
-  BrotliCompressor compressor(params);
   BrotliMemIn in(input_buffer, input_size);
   BrotliMemOut out(encoded_buffer, *encoded_size);
   if (!BrotliCompress(params, &in, &out)) {
@@ -651,36 +756,26 @@ int BrotliCompressBuffer(BrotliParams params,
   return 1;
 }
 
-size_t CopyOneBlockToRingBuffer(BrotliIn* r, BrotliCompressor* compressor) {
-  const size_t block_size = compressor->input_block_size();
-  size_t bytes_read = 0;
-  const uint8_t* data = reinterpret_cast<const uint8_t*>(
-      r->Read(block_size, &bytes_read));
-  if (data == NULL) {
-    return 0;
-  }
-  compressor->CopyInputToRingBuffer(bytes_read, data);
-
-  // Read more bytes until block_size is filled or an EOF (data == NULL) is
-  // received. This is useful to get deterministic compressed output for the
-  // same input no matter how r->Read splits the input to chunks.
-  for (size_t remaining = block_size - bytes_read; remaining > 0; ) {
-    size_t more_bytes_read = 0;
-    data = reinterpret_cast<const uint8_t*>(
-        r->Read(remaining, &more_bytes_read));
-    if (data == NULL) {
-      break;
+// Copies at most block_size bytes of input from r to the ring buffer of the
+// compressor and returns the number of bytes copied. If last_bytes is not
+// NULL, the last two bytes copied so far are kept in last_bytes[0] and
+// last_bytes[1], in this order.
+size_t CopyBlockToRingBuffer(BrotliIn* r, size_t block_size,
+                             BrotliCompressor* compressor,
+                             uint8_t* last_bytes) {
+  return ReadInputBlock(r, block_size,
+                        [=](const uint8_t* data, size_t n) {
+    compressor->CopyInputToRingBuffer(n, data);
+    if (last_bytes != NULL && n > 0) {
+      last_bytes[0] = n > 1 ? data[n - 2] : last_bytes[1];
+      last_bytes[1] = data[n - 1];
     }
-    compressor->CopyInputToRingBuffer(more_bytes_read, data);
-    bytes_read += more_bytes_read;
-    remaining -= more_bytes_read;
-  }
-  return bytes_read;
+  });
 }
 
-bool BrotliInIsFinished(BrotliIn* r) {
-  size_t read_bytes;
-  return r->Read(0, &read_bytes) == NULL;
+size_t CopyOneBlockToRingBuffer(BrotliIn* r, BrotliCompressor* compressor) {
+  return CopyBlockToRingBuffer(r, compressor->next_block_size(), compressor,
+                               NULL);
 }
 
 int BrotliCompress(BrotliParams params, BrotliIn* in, BrotliOut* out) {
@@ -712,4 +807,95 @@ int BrotliCompressWithCustomDictionary(size_t dictsize, const uint8_t* dict,
   return true;
 }
 
+// The index has to fit into a single metadata meta-block.
+static const size_t kMaxSeekPoints =
+    ((1 << 24) - kSeekIndexTrailerSize) / kSeekPointSize;
+
+static void AppendLittleEndian(uint64_t value, int n,
+                               std::vector<uint8_t>* out) {
+  for (int i = 0; i < n; ++i) {
+    out->push_back(static_cast<uint8_t>(value >> (8 * i)));
+  }
+}
+
+// Drops every other seek point of the index, starting with the first one,
+// so that the remaining ones are twice as far apart.
+static void ThinSeekIndex(std::vector<uint8_t>* index,
+                          uint32_t* num_seek_points) {
+  uint32_t n = 0;
+  for (uint32_t i = 1; i < *num_seek_points; i += 2, ++n) {
+    std::copy(index->begin() + i * kSeekPointSize,
+              index->begin() + (i + 1) * kSeekPointSize,
+              index->begin() + n * kSeekPointSize);
+  }
+  *num_seek_points = n;
+  index->resize(n * kSeekPointSize);
+}
+
+int BrotliCompressSeekable(BrotliParams params, BrotliIn* in, BrotliOut* out) {
+  if (params.lgseek == 0) {
+    params.lgseek = 20;
+  }
+  BrotliCompressor compressor(params);
+  // The seek index, see the decoder for its format.
+  std::vector<uint8_t> index;
+  uint32_t num_seek_points = 0;
+  // Only every seek_point_stride-th independent meta-block gets a seek
+  // point, so that the index does not outgrow kMaxSeekPoints.
+  size_t seek_point_stride = 1;
+  size_t num_independent_blocks = 0;
+  uint8_t last_bytes[2] = { 0, 0 };
+  size_t input_pos = 0;
+  size_t output_pos = 0;
+  bool pending = false;
+  bool final_block = false;
+  uint8_t* output;
+  size_t out_bytes;
+  while (!final_block) {
+    size_t in_bytes = CopyBlockToRingBuffer(
+        in, compressor.next_block_size(), &compressor, last_bytes);
+    input_pos += in_bytes;
+    pending = pending || in_bytes > 0;
+    final_block = in_bytes == 0 || BrotliInIsFinished(in);
+    // The stream is ended by the metadata meta-block of the index, so none
+    // of the data meta-blocks is the last one.
+    out_bytes = 0;
+    if (pending && !compressor.WriteBrotliData(
+            false, /* force_flush = */ final_block, &out_bytes, &output)) {
+      return false;
+    }
+    if (out_bytes > 0) {
+      if (!out->Write(output, out_bytes)) {
+        return false;
+      }
+      output_pos += out_bytes;
+      pending = false;
+    }
+    if (compressor.at_independent_meta_block() && !final_block &&
+        ++num_independent_blocks % seek_point_stride == 0) {
+      if (num_seek_points == kMaxSeekPoints) {
+        ThinSeekIndex(&index, &num_seek_points);
+        seek_point_stride *= 2;
+      }
+      if (num_independent_blocks % seek_point_stride == 0) {
+        AppendLittleEndian(input_pos, 8, &index);
+        AppendLittleEndian(output_pos, 8, &index);
+        index.push_back(last_bytes[0]);
+        index.push_back(last_bytes[1]);
+        ++num_seek_points;
+      }
+    }
+  }
+  AppendLittleEndian(input_pos, 8, &index);
+  AppendLittleEndian(num_seek_points, 4, &index);
+  index.insert(index.end(), kSeekIndexMagic, kSeekIndexMagic + 4);
+  std::vector<uint8_t> storage(index.size() + 6 + 1);
+  out_bytes = storage.size();
+  if (!compressor.WriteMetadata(index.size(), &index[0], true,
+                                &out_bytes, &storage[0])) {
+    return false;
+  }
+  return out->Write(&storage[0], out_bytes);
+}
+
 }  // namespace brotli
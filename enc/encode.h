@@ -23,6 +23,7 @@
 #include <vector>
 #include "./command.h"
 #include "./hash.h"
+#include "./memory.h"
 #include "./ringbuffer.h"
 #include "./static_dict.h"
 #include "./streams.h"
@@ -40,10 +41,13 @@ struct BrotliParams {
         quality(11),
         lgwin(22),
         lgblock(0),
+        lgseek(0),
+        zopfli_iterations(0),
         enable_dictionary(true),
         enable_transforms(false),
         greedy_block_split(false),
-        enable_context_modeling(true) {}
+        enable_context_modeling(true),
+        allocator(NULL) {}
 
   enum Mode {
     // Default compression mode. The compressor does not know anything in
@@ -64,6 +68,19 @@ struct BrotliParams {
   // Base 2 logarithm of the maximum input block size. Range is 16 to 24.
   // If set to 0, the value will be set based on the quality.
   int lgblock;
+  // Base 2 logarithm of the distance between independent meta-blocks, see
+  // BrotliCompressor::StartIndependentMetaBlock(). If not 0, the compressor
+  // flushes and starts an independent meta-block after the input block that
+  // reaches each multiple of (1 << lgseek) bytes of input. The compression
+  // ratio gets somewhat worse the smaller it is. Range is 16 to 30.
+  int lgseek;
+  // Maximum number of passes of the backward reference search at quality 10
+  // and above. Each pass after the first one uses a cost model that is built
+  // from the commands of the pass before it, and the passes stop early once
+  // the estimated cost of the meta-block does not go down any more. More
+  // passes give somewhat denser output for more CPU time. If set to 0, the
+  // value is 1 at quality 10 and 2 at quality 11.
+  int zopfli_iterations;
 
   // These settings are deprecated and will be ignored.
   // All speed vs. size compromises are controlled by the quality param.
@@ -71,17 +88,39 @@ struct BrotliParams {
   bool enable_transforms;
   bool greedy_block_split;
   bool enable_context_modeling;
+
+  // Allocator for the memory of the compressor, which has to outlive it.
+  // If NULL, malloc() and free() are used. If an allocation fails, the
+  // compression functions return an error.
+  BrotliAllocator* allocator;
 };
 
-// An instance can not be reused for multiple brotli streams.
+// An instance can be reused for multiple brotli streams by calling Reset()
+// between them.
 class BrotliCompressor {
  public:
   explicit BrotliCompressor(BrotliParams params);
   ~BrotliCompressor();
 
+  // Resets the compressor to the state right after construction, so that a
+  // new brotli stream can be compressed with the same parameters. The
+  // internal buffers are kept and reused.
+  void Reset();
+
   // The maximum input size that can be processed at once.
   size_t input_block_size() const { return 1 << params_.lgblock; }
 
+  // The input size to copy to the ring buffer before the next
+  // WriteBrotliData() call, which is input_block_size(), unless the next
+  // independent meta-block starts before that.
+  size_t next_block_size() const {
+    if (params_.lgseek > 0 &&
+        next_independent_pos_ - input_pos_ < input_block_size()) {
+      return next_independent_pos_ - input_pos_;
+    }
+    return input_block_size();
+  }
+
   // Encodes the data in input_buffer as a meta-block and writes it to
   // encoded_buffer (*encoded_size should be set to the size of
   // encoded_buffer) and sets *encoded_size to the number of bytes that
@@ -104,6 +143,25 @@ class BrotliCompressor {
                      size_t* encoded_size,
                      uint8_t* encoded_buffer);
 
+  // Makes the meta-blocks after the current input position independent of
+  // the data before it: their backward references and distance codes do not
+  // reach before it. If the stream is not at a byte boundary, an empty
+  // metadata meta-block is written to encoded_buffer (*encoded_size should
+  // be set to its size, at least 2 bytes) to align it, and *encoded_size is
+  // set to the number of bytes written. A decoder can then start decoding at
+  // the next meta-block, if it knows the current input position and the last
+  // two bytes before it. This does not work with a custom dictionary. All
+  // input has to be written with WriteBrotliData() before. Returns false if
+  // there was an error and true otherwise.
+  bool StartIndependentMetaBlock(size_t* encoded_size,
+                                 uint8_t* encoded_buffer);
+
+  // Returns true if the output of the last WriteBrotliData() call ended with
+  // the start of an independent meta-block because of params.lgseek.
+  bool at_independent_meta_block() const {
+    return at_independent_meta_block_;
+  }
+
   // Writes a zero-length meta-block with end-of-input bit set to the
   // internal output buffer and copies the output buffer to encoded_buffer
   // (*encoded_size should be set to the size of encoded_buffer) and sets
@@ -142,26 +200,42 @@ class BrotliCompressor {
  private:
   uint8_t* GetBrotliStorage(size_t size);
 
+  // Initializes the per-stream state that is not kept in buffers.
+  void ResetState();
+
   bool WriteMetaBlockInternal(const bool is_last,
                               const bool utf8_mode,
                               size_t* out_size,
                               uint8_t** output);
 
+  // Aligns the bit stream in storage, which ends at *storage_ix, and clears
+  // the state that refers to the input before, see
+  // StartIndependentMetaBlock().
+  void StartIndependentMetaBlockInternal(int* storage_ix, uint8_t* storage);
+
   BrotliParams params_;
+  BrotliAllocator* allocator_;
+  // False if one of the buffers could not be allocated.
+  bool buffers_ok_;
   int max_backward_distance_;
   std::unique_ptr<Hashers> hashers_;
   int hash_type_;
+  bool hashers_ready_;
   size_t input_pos_;
   std::unique_ptr<RingBuffer> ringbuffer_;
-  std::unique_ptr<float[]> literal_cost_;
+  AllocatedPtr<float[]> literal_cost_;
   size_t literal_cost_mask_;
   size_t cmd_buffer_size_;
-  std::unique_ptr<Command[]> commands_;
+  AllocatedPtr<Command[]> commands_;
   int num_commands_;
   int num_literals_;
   int last_insert_len_;
   size_t last_flush_pos_;
   size_t last_processed_pos_;
+  // Input position of the next independent meta-block if params_.lgseek is
+  // set.
+  size_t next_independent_pos_;
+  bool at_independent_meta_block_;
   int dist_cache_[4];
   int saved_dist_cache_[4];
   uint8_t last_byte_;
@@ -169,7 +243,9 @@ class BrotliCompressor {
   uint8_t prev_byte_;
   uint8_t prev_byte2_;
   int storage_size_;
-  std::unique_ptr<uint8_t[]> storage_;
+  AllocatedPtr<uint8_t[]> storage_;
+  // Temporary memory of the meta-block being processed.
+  MemoryArena arena_;
 };
 
 // Compresses the data in input_buffer into encoded_buffer, and sets
@@ -191,6 +267,15 @@ int BrotliCompressWithCustomDictionary(size_t dictsize, const uint8_t* dict,
                                        BrotliParams params,
                                        BrotliIn* in, BrotliOut* out);
 
+// Same as BrotliCompress, but ends the stream with an index of the
+// independent meta-blocks, see params.lgseek, in a metadata meta-block.
+// BrotliDecompressRange of the decoder uses the index to start decoding at
+// the last of them before the requested range, instead of at the start of
+// the stream. If params.lgseek is 0, it is set to 20. If the input has more
+// than about 900000 independent meta-blocks, only every second, fourth, etc.
+// of them is in the index, so that it fits into one metadata meta-block.
+int BrotliCompressSeekable(BrotliParams params, BrotliIn* in, BrotliOut* out);
+
 }  // namespace brotli
 
 #endif  // BROTLI_ENC_ENCODE_H_
@@ -17,7 +17,16 @@
 #include "./encode_parallel.h"
 
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include "./backward_references.h"
 #include "./bit_cost.h"
@@ -126,6 +135,7 @@ bool WriteMetaBlockParallel(const BrotliParams& params,
                             const uint8_t* prefix_buffer,
                             const bool is_first,
                             const bool is_last,
+                            const bool warmup_hashers,
                             size_t* encoded_size,
                             uint8_t* encoded_buffer) {
   if (block_size == 0) {
@@ -166,9 +176,17 @@ bool WriteMetaBlockParallel(const BrotliParams& params,
   }
 
   // Initialize hashers.
-  int hash_type = std::min(9, params.quality);
-  std::unique_ptr<Hashers> hashers(new Hashers());
-  hashers->Init(hash_type);
+  int hash_type = Hashers::HasherTypeForQuality(params.quality);
+  BrotliAllocator* allocator =
+      params.allocator != NULL ? params.allocator : DefaultAllocator();
+  std::unique_ptr<Hashers> hashers(new Hashers(allocator));
+  if (!hashers->Init(hash_type, params.lgwin)) {
+    return false;
+  }
+  hashers->Prepare(hash_type, true, prefix_size + input_size, &input[0]);
+  if (warmup_hashers) {
+    hashers->PrependCustomDictionary(hash_type, prefix_size, &input[0]);
+  }
 
   // Compute backward references.
   int last_insert_len = 0;
@@ -177,19 +195,24 @@ bool WriteMetaBlockParallel(const BrotliParams& params,
   int max_backward_distance = (1 << params.lgwin) - 16;
   int dist_cache[4] = { -4, -4, -4, -4 };
   std::vector<Command> commands((input_size + 1) >> 1);
-  CreateBackwardReferences(
-      input_size, input_pos,
-      &input[0], mask,
-      &literal_cost[0], mask,
-      max_backward_distance,
-      params.quality,
-      hashers.get(),
-      hash_type,
-      dist_cache,
-      &last_insert_len,
-      &commands[0],
-      &num_commands,
-      &num_literals);
+  MemoryArena arena(allocator);
+  if (!CreateBackwardReferences(
+          input_size, input_pos,
+          &input[0], mask,
+          &literal_cost[0], mask,
+          max_backward_distance,
+          params.quality,
+          params.zopfli_iterations,
+          hashers.get(),
+          hash_type,
+          &arena,
+          dist_cache,
+          &last_insert_len,
+          &commands[0],
+          &num_commands,
+          &num_literals)) {
+    return false;
+  }
   commands.resize(num_commands);
   if (last_insert_len > 0) {
     commands.push_back(Command(last_insert_len));
@@ -279,9 +302,115 @@ bool WriteMetaBlockParallel(const BrotliParams& params,
   return true;
 }
 
+void SanitizeParams(BrotliParams* params) {
+  if (params->lgwin < kMinWindowBits) {
+    params->lgwin = kMinWindowBits;
+  } else if (params->lgwin > kMaxWindowBits) {
+    params->lgwin = kMaxWindowBits;
+  }
+  if (params->lgblock == 0) {
+    params->lgblock = 16;
+    if (params->quality >= 9 && params->lgwin > params->lgblock) {
+      params->lgblock = std::min(21, params->lgwin);
+    }
+  } else if (params->lgblock < kMinInputBlockBits) {
+    params->lgblock = kMinInputBlockBits;
+  } else if (params->lgblock > kMaxInputBlockBits) {
+    params->lgblock = kMaxInputBlockBits;
+  }
+}
+
+// Compresses the block_size bytes at data[prefix_size] into *out, using the
+// prefix_size bytes before them as the prefix of the block.
+bool CompressInputBlock(const BrotliParams& params,
+                        const BrotliParallelParams& parallel_params,
+                        const uint8_t* data,
+                        const size_t prefix_size,
+                        const size_t block_size,
+                        const bool is_first,
+                        const bool is_last,
+                        std::vector<uint8_t>* out) {
+  size_t out_size = 1.2 * block_size + 1024;
+  out->resize(out_size);
+  if (!WriteMetaBlockParallel(params,
+                              block_size,
+                              &data[prefix_size],
+                              prefix_size,
+                              data,
+                              is_first,
+                              is_last,
+                              parallel_params.warmup_hashers,
+                              &out_size,
+                              &(*out)[0])) {
+    return false;
+  }
+  out->resize(out_size);
+  return true;
+}
+
+// A fixed set of worker threads that run the submitted jobs in FIFO order.
+// Each job is called with the index of the worker thread that runs it.
+// The destructor waits until all submitted jobs are finished.
+class WorkerPool {
+ public:
+  explicit WorkerPool(int num_threads) : done_(false) {
+    for (int i = 0; i < num_threads; ++i) {
+      workers_.push_back(std::thread(&WorkerPool::Run, this, i));
+    }
+  }
+
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      done_ = true;
+    }
+    cond_.notify_all();
+    for (size_t i = 0; i < workers_.size(); ++i) {
+      workers_[i].join();
+    }
+  }
+
+  // Queues the job and returns a future for its result.
+  std::future<bool> Submit(const std::function<bool(int)>& job) {
+    std::shared_ptr<std::packaged_task<bool(int)> > task(
+        new std::packaged_task<bool(int)>(job));
+    std::future<bool> result = task->get_future();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      jobs_.push_back([task](int worker) { (*task)(worker); });
+    }
+    cond_.notify_one();
+    return result;
+  }
+
+ private:
+  void Run(int worker) {
+    for (;;) {
+      std::function<void(int)> job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.wait(lock, [this]() { return done_ || !jobs_.empty(); });
+        if (jobs_.empty()) {
+          return;
+        }
+        job = jobs_.front();
+        jobs_.pop_front();
+      }
+      job(worker);
+    }
+  }
+
+  std::vector<std::thread> workers_;
+  std::deque<std::function<void(int)> > jobs_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  bool done_;
+};
+
 }  // namespace
 
 int BrotliCompressBufferParallel(BrotliParams params,
+                                 BrotliParallelParams parallel_params,
                                  size_t input_size,
                                  const uint8_t* input_buffer,
                                  size_t* encoded_size,
@@ -295,45 +424,63 @@ int BrotliCompressBufferParallel(BrotliParams params,
     return 1;
   }
 
-  // Sanitize params.
-  if (params.lgwin < kMinWindowBits) {
-    params.lgwin = kMinWindowBits;
-  } else if (params.lgwin > kMaxWindowBits) {
-    params.lgwin = kMaxWindowBits;
-  }
-  if (params.lgblock == 0) {
-    params.lgblock = 16;
-    if (params.quality >= 9 && params.lgwin > params.lgblock) {
-      params.lgblock = std::min(21, params.lgwin);
-    }
-  } else if (params.lgblock < kMinInputBlockBits) {
-    params.lgblock = kMinInputBlockBits;
-  } else if (params.lgblock > kMaxInputBlockBits) {
-    params.lgblock = kMaxInputBlockBits;
-  }
+  SanitizeParams(&params);
   size_t max_input_block_size = 1 << params.lgblock;
+  // Backward references can not reach further back than the window, so the
+  // prefix of each block is capped at the window size. This keeps the memory
+  // used by each block proportional to the window instead of to the input.
+  size_t max_prefix_size = 1 << params.lgwin;
+  size_t num_blocks =
+      (input_size + max_input_block_size - 1) / max_input_block_size;
+  size_t num_threads = std::min<size_t>(
+      std::max(1, parallel_params.num_threads), num_blocks);
 
-  std::vector<std::vector<uint8_t> > compressed_pieces;
+  std::vector<std::vector<uint8_t> > compressed_pieces(num_blocks);
 
   // Compress block-by-block independently.
-  for (size_t pos = 0; pos < input_size; ) {
-    size_t input_block_size = std::min(max_input_block_size, input_size - pos);
-    size_t out_size = 1.2 * input_block_size + 1024;
-    std::vector<uint8_t> out(out_size);
-    if (!WriteMetaBlockParallel(params,
-                                input_block_size,
-                                &input_buffer[pos],
-                                pos,
-                                input_buffer,
-                                pos == 0,
-                                pos + input_block_size == input_size,
-                                &out_size,
-                                &out[0])) {
+  if (num_threads == 1) {
+    for (size_t i = 0; i < num_blocks; ++i) {
+      size_t pos = i * max_input_block_size;
+      size_t input_block_size =
+          std::min(max_input_block_size, input_size - pos);
+      size_t prefix_size = std::min(max_prefix_size, pos);
+      if (!CompressInputBlock(params, parallel_params,
+                              &input_buffer[pos - prefix_size], prefix_size,
+                              input_block_size, pos == 0,
+                              pos + input_block_size == input_size,
+                              &compressed_pieces[i])) {
+        return false;
+      }
+    }
+  } else {
+    bool ok = true;
+    {
+      WorkerPool pool(num_threads);
+      std::vector<std::future<bool> > results;
+      for (size_t i = 0; i < num_blocks; ++i) {
+        size_t pos = i * max_input_block_size;
+        size_t input_block_size =
+            std::min(max_input_block_size, input_size - pos);
+        size_t prefix_size = std::min(max_prefix_size, pos);
+        const uint8_t* data = &input_buffer[pos - prefix_size];
+        bool is_first = pos == 0;
+        bool is_last = pos + input_block_size == input_size;
+        std::vector<uint8_t>* out = &compressed_pieces[i];
+        results.push_back(pool.Submit([&params, &parallel_params, data,
+                                       prefix_size, input_block_size,
+                                       is_first, is_last, out](int) {
+          return CompressInputBlock(params, parallel_params,
+                                    data, prefix_size, input_block_size,
+                                    is_first, is_last, out);
+        }));
+      }
+      for (size_t i = 0; i < results.size(); ++i) {
+        ok &= results[i].get();
+      }
+    }
+    if (!ok) {
       return false;
     }
-    out.resize(out_size);
-    compressed_pieces.push_back(out);
-    pos += input_block_size;
   }
 
   // Piece together the output.
@@ -351,4 +498,125 @@ int BrotliCompressBufferParallel(BrotliParams params,
   return true;
 }
 
+int BrotliCompressParallel(BrotliParams params,
+                           BrotliParallelParams parallel_params,
+                           BrotliIn* in, BrotliOut* out,
+                           std::vector<BrotliWorkerStats>* worker_stats) {
+  SanitizeParams(&params);
+  const size_t max_input_block_size = 1 << params.lgblock;
+  const size_t max_prefix_size = 1 << params.lgwin;
+  const size_t max_pending_blocks = std::max(1, parallel_params.num_threads);
+  if (worker_stats != NULL && worker_stats->size() < max_pending_blocks) {
+    worker_stats->resize(max_pending_blocks);
+  }
+
+  // A block that is queued for compression but not yet written to the output.
+  struct PendingBlock {
+    std::future<bool> result;
+    std::shared_ptr<std::vector<uint8_t> > output;
+  };
+  std::deque<PendingBlock> pending;
+  WorkerPool pool(max_pending_blocks);
+
+  // The last block read and its prefix.
+  std::shared_ptr<std::vector<uint8_t> > data;
+  bool is_first = true;
+  bool is_last = false;
+  bool ok = true;
+  while (ok && !is_last) {
+    // Start the next block with the window-sized tail of the previous one.
+    std::shared_ptr<std::vector<uint8_t> > next(new std::vector<uint8_t>);
+    size_t prefix_size = 0;
+    if (data) {
+      prefix_size = std::min(max_prefix_size, data->size());
+      next->reserve(prefix_size + max_input_block_size);
+      next->assign(data->end() - prefix_size, data->end());
+    }
+    size_t block_size = ReadInputBlock(
+        in, max_input_block_size, [&next](const uint8_t* buf, size_t n) {
+      next->insert(next->end(), buf, buf + n);
+    });
+    if (block_size == 0) {
+      break;
+    }
+    is_last = BrotliInIsFinished(in);
+    data = next;
+
+    // Keep at most max_pending_blocks blocks in flight.
+    while (ok && pending.size() >= max_pending_blocks) {
+      PendingBlock& block = pending.front();
+      ok = block.result.get() &&
+          out->Write(&(*block.output)[0], block.output->size());
+      pending.pop_front();
+    }
+
+    PendingBlock block;
+    block.output.reset(new std::vector<uint8_t>);
+    std::shared_ptr<std::vector<uint8_t> > output = block.output;
+    block.result = pool.Submit([&params, &parallel_params, worker_stats,
+                                data, prefix_size, block_size, is_first,
+                                is_last, output](int worker) {
+      const std::chrono::steady_clock::time_point start =
+          std::chrono::steady_clock::now();
+      if (!CompressInputBlock(params, parallel_params,
+                              &(*data)[0], prefix_size, block_size,
+                              is_first, is_last, output.get())) {
+        return false;
+      }
+      if (worker_stats != NULL) {
+        // Each worker only updates its own entry.
+        BrotliWorkerStats* stats = &(*worker_stats)[worker];
+        ++stats->num_blocks;
+        stats->input_bytes += block_size;
+        stats->output_bytes += output->size();
+        stats->seconds += std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+      }
+      return true;
+    });
+    pending.push_back(std::move(block));
+    is_first = false;
+  }
+
+  // Write out the rest of the blocks in order.
+  while (!pending.empty()) {
+    PendingBlock& block = pending.front();
+    ok = block.result.get() && ok &&
+        out->Write(&(*block.output)[0], block.output->size());
+    pending.pop_front();
+  }
+  if (!ok) {
+    return false;
+  }
+
+  if (data == nullptr) {
+    // Empty input, write an empty stream.
+    const uint8_t empty_stream = 6;
+    return out->Write(&empty_stream, 1);
+  } else if (!is_last) {
+    // The input ended right after a full block that was not marked as the
+    // last one. Since the blocks end at a byte boundary, finish the stream
+    // with an empty last meta-block.
+    const uint8_t empty_last_meta_block = 3;
+    return out->Write(&empty_last_meta_block, 1);
+  }
+  return true;
+}
+
+int BrotliCompressParallel(BrotliParams params,
+                           BrotliParallelParams parallel_params,
+                           BrotliIn* in, BrotliOut* out) {
+  return BrotliCompressParallel(params, parallel_params, in, out, NULL);
+}
+
+int BrotliCompressBufferParallel(BrotliParams params,
+                                 size_t input_size,
+                                 const uint8_t* input_buffer,
+                                 size_t* encoded_size,
+                                 uint8_t* encoded_buffer) {
+  return BrotliCompressBufferParallel(params, BrotliParallelParams(),
+                                      input_size, input_buffer,
+                                      encoded_size, encoded_buffer);
+}
+
 }  // namespace brotli
@@ -21,17 +21,81 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <vector>
 
 #include "./encode.h"
 
 namespace brotli {
 
+// Settings of the parallel compressor that are not part of BrotliParams.
+struct BrotliParallelParams {
+  BrotliParallelParams() : num_threads(1), warmup_hashers(false) {}
+
+  // Number of worker threads that compress input blocks concurrently.
+  // Values smaller than 1 are treated as 1.
+  int num_threads;
+  // If true, the hasher of each block is filled with the window-sized input
+  // prefix before the block, so that backward references can reach into the
+  // preceding blocks. This brings the compression ratio close to that of the
+  // serial compressor, at the cost of hashing the prefix for every block.
+  bool warmup_hashers;
+};
+
+// Work done by one worker thread of the parallel compressor.
+struct BrotliWorkerStats {
+  BrotliWorkerStats()
+      : num_blocks(0), input_bytes(0), output_bytes(0), seconds(0) {}
+
+  // Number of input blocks compressed.
+  int num_blocks;
+  // Total size of those blocks before and after compression.
+  size_t input_bytes;
+  size_t output_bytes;
+  // Wall-clock time spent compressing them.
+  double seconds;
+};
+
+// Compresses the data in input_buffer into encoded_buffer, and sets
+// *encoded_size to the compressed length. The input is split into blocks of
+// (1 << params.lgblock) bytes that are compressed independently of each other
+// on parallel_params.num_threads worker threads. The output does not depend on
+// the number of threads. If params.allocator is set, it is called from all
+// worker threads concurrently.
+// Returns 0 if there was an error and 1 otherwise.
+int BrotliCompressBufferParallel(BrotliParams params,
+                                 BrotliParallelParams parallel_params,
+                                 size_t input_size,
+                                 const uint8_t* input_buffer,
+                                 size_t* encoded_size,
+                                 uint8_t* encoded_buffer);
+
+// Same as above, but compresses the blocks one after another on the calling
+// thread.
 int BrotliCompressBufferParallel(BrotliParams params,
                                  size_t input_size,
                                  const uint8_t* input_buffer,
                                  size_t* encoded_size,
                                  uint8_t* encoded_buffer);
 
+// Same as BrotliCompress, but reads the input in blocks of
+// (1 << params.lgblock) bytes from in and compresses them on
+// parallel_params.num_threads worker threads. The compressed blocks are
+// written to out in order. At most num_threads blocks are in flight at any
+// time, and each of them holds a copy of the window before it, so memory use
+// does not depend on the input size.
+// Returns 0 if there was an error and 1 otherwise.
+int BrotliCompressParallel(BrotliParams params,
+                           BrotliParallelParams parallel_params,
+                           BrotliIn* in, BrotliOut* out);
+
+// Same as above, but also adds the work done by each worker thread to the
+// corresponding element of *worker_stats, which is grown to
+// parallel_params.num_threads elements if it is shorter.
+int BrotliCompressParallel(BrotliParams params,
+                           BrotliParallelParams parallel_params,
+                           BrotliIn* in, BrotliOut* out,
+                           std::vector<BrotliWorkerStats>* worker_stats);
+
 }  // namespace brotli
 
 #endif  // BROTLI_ENC_ENCODE_PARALLEL_H_
@@ -29,6 +29,7 @@
 
 #include "./dictionary_hash.h"
 #include "./fast_log.h"
+#include "./memory.h"
 #include "./find_match_length.h"
 #include "./port.h"
 #include "./prefix.h"
@@ -122,9 +123,9 @@ struct BackwardMatch {
 template <int kBucketBits, int kBucketSweep, bool kUseDictionary>
 class HashLongestMatchQuickly {
  public:
-  HashLongestMatchQuickly() {
-    Reset();
-  }
+  // The hasher has to be cleared with Reset() or Prepare() before use.
+  HashLongestMatchQuickly() {}
+
   void Reset() {
     // It is not strictly necessary to fill this buffer here, but
     // not filling will make the results of the compression stochastic
@@ -133,6 +134,39 @@ class HashLongestMatchQuickly {
     memset(&buckets_[0], 0, sizeof(buckets_));
     num_dict_lookups_ = 0;
     num_dict_matches_ = 0;
+    first_ix_ = 0;
+  }
+
+  // Clears the hasher as if the stream started at position, so that no
+  // backward references to the data before it are found.
+  void ResetAt(size_t position) {
+    Reset();
+    // The empty buckets point to position, which can only be found from
+    // later positions.
+    std::fill(&buckets_[0], &buckets_[0] + kBucketSize + kBucketSweep,
+              static_cast<uint32_t>(position));
+    first_ix_ = position;
+  }
+
+  // Returns the position where the hasher was last cleared.
+  size_t first_position() const { return first_ix_; }
+
+  // Clears the hasher before compressing a new stream. If one_shot is true,
+  // data holds the whole input_size bytes of the stream. For small inputs,
+  // only the buckets that can be looked up are cleared then, which makes the
+  // result the same as that of Reset() at a cost of O(input_size).
+  void Prepare(bool one_shot, size_t input_size, const uint8_t* data) {
+    if (one_shot && input_size <= (kBucketSize >> 6)) {
+      for (size_t i = 0; i + kHashTypeLength <= input_size; ++i) {
+        const uint32_t key = HashBytes(&data[i]);
+        memset(&buckets_[key], 0, kBucketSweep * sizeof(buckets_[0]));
+      }
+      num_dict_lookups_ = 0;
+      num_dict_matches_ = 0;
+      first_ix_ = 0;
+    } else {
+      Reset();
+    }
   }
   // Look at 4 bytes at data.
   // Compute a hash from these, and store the value somewhere within
@@ -177,7 +211,7 @@ class HashLongestMatchQuickly {
     int backward = distance_cache[0];
     size_t prev_ix = cur_ix - backward;
     bool match_found = false;
-    if (prev_ix < cur_ix) {
+    if (prev_ix < cur_ix && prev_ix >= first_ix_) {
       prev_ix &= ring_buffer_mask;
       if (compare_char == ring_buffer[prev_ix + best_len]) {
         int len = FindMatchLengthWithLimit(&ring_buffer[prev_ix],
@@ -309,6 +343,8 @@ class HashLongestMatchQuickly {
   uint32_t buckets_[kBucketSize + kBucketSweep];
   size_t num_dict_lookups_;
   size_t num_dict_matches_;
+  // Position where the hasher was last cleared.
+  size_t first_ix_;
 };
 
 // The maximum length for which the zopflification uses distinct distances.
@@ -325,14 +361,41 @@ template <int kBucketBits,
           int kNumLastDistancesToCheck>
 class HashLongestMatch {
  public:
-  HashLongestMatch() {
-    Reset();
-  }
+  // The hasher has to be cleared with Reset() or Prepare() before use.
+  HashLongestMatch() {}
 
   void Reset() {
     memset(&num_[0], 0, sizeof(num_));
     num_dict_lookups_ = 0;
     num_dict_matches_ = 0;
+    first_ix_ = 0;
+  }
+
+  // Clears the hasher as if the stream started at position, so that no
+  // backward references to the data before it are found.
+  void ResetAt(size_t position) {
+    Reset();
+    first_ix_ = position;
+  }
+
+  // Returns the position where the hasher was last cleared.
+  size_t first_position() const { return first_ix_; }
+
+  // Clears the hasher before compressing a new stream. If one_shot is true,
+  // data holds the whole input_size bytes of the stream. For small inputs,
+  // only the buckets that can be looked up are cleared then, which makes the
+  // result the same as that of Reset() at a cost of O(input_size).
+  void Prepare(bool one_shot, size_t input_size, const uint8_t* data) {
+    if (one_shot && input_size <= (kBucketSize >> 6)) {
+      for (size_t i = 0; i + kHashTypeLength <= input_size; ++i) {
+        num_[HashBytes(&data[i])] = 0;
+      }
+      num_dict_lookups_ = 0;
+      num_dict_matches_ = 0;
+      first_ix_ = 0;
+    } else {
+      Reset();
+    }
   }
 
   // Look at 3 bytes at data.
@@ -382,7 +445,7 @@ class HashLongestMatch {
       const int idx = kDistanceCacheIndex[i];
       const int backward = distance_cache[idx] + kDistanceCacheOffset[i];
       size_t prev_ix = cur_ix - backward;
-      if (prev_ix >= cur_ix) {
+      if (prev_ix >= cur_ix || prev_ix < first_ix_) {
         continue;
       }
       if (PREDICT_FALSE(backward > max_backward)) {
@@ -488,10 +551,156 @@ class HashLongestMatch {
     return match_found;
   }
 
-  // Similar to FindLongestMatch(), but finds all matches.
+  enum { kHashLength = 4 };
+  enum { kHashTypeLength = 4 };
+
+  // HashBytes is the function that chooses the bucket to place
+  // the address in. The HashLongestMatch and HashLongestMatchQuickly
+  // classes have separate, different implementations of hashing.
+  static uint32_t HashBytes(const uint8_t *data) {
+    // kHashMul32 multiplier has these properties:
+    // * The multiplier must be odd. Otherwise we may lose the highest bit.
+    // * No long streaks of 1s or 0s.
+    // * Is not unfortunate (see the unittest) for the English language.
+    // * There is no effort to ensure that it is a prime, the oddity is enough
+    //   for this use.
+    // * The number has been tuned heuristically against compression benchmarks.
+    static const uint32_t kHashMul32 = 0x1e35a7bd;
+    uint32_t h = BROTLI_UNALIGNED_LOAD32(data) * kHashMul32;
+    // The higher bits contain more mixture from the multiplication,
+    // so we take our results from there.
+    return h >> (32 - kBucketBits);
+  }
+
+ private:
+  // Number of hash buckets.
+  static const uint32_t kBucketSize = 1 << kBucketBits;
+
+  // Only kBlockSize newest backward references are kept,
+  // and the older are forgotten.
+  static const uint32_t kBlockSize = 1 << kBlockBits;
+
+  // Mask for accessing entries in a block (in a ringbuffer manner).
+  static const uint32_t kBlockMask = (1 << kBlockBits) - 1;
+
+  // Number of entries in a particular bucket.
+  uint16_t num_[kBucketSize];
+
+  // Buckets containing kBlockSize of backward references.
+  int buckets_[kBucketSize][kBlockSize];
+
+  size_t num_dict_lookups_;
+  size_t num_dict_matches_;
+  // Position where the hasher was last cleared.
+  size_t first_ix_;
+};
+
+// A binary tree of the data seen by the compressor, to find all backward
+// references of a position, for the zopflification.
+//
+// This is a hash map of fixed size (kBucketSize) from the hash of four bytes
+// to the most recent position with that hash, which is the root of a binary
+// tree of the earlier positions with that hash. The trees are ordered by the
+// strings starting at their positions, and stored in a forest of two child
+// pointers per position of the window. A lookup walks down the tree of its
+// hash, finding the longest matches on the way, and makes the current
+// position the new root, like the BT4 match finder of LZMA.
+template <int kBucketBits>
+class HashToBinaryTree {
+ public:
+  // The hasher has to be given its forest with Init() and cleared with
+  // Reset() or Prepare() before use.
+  HashToBinaryTree() : forest_(NULL), window_mask_(0), invalid_pos_(0) {}
+
+  // Sets the forest of the trees, 2 << forest_bits entries that are owned
+  // by the caller. Backward references are at most the window size minus
+  // 16 long, see section 9.1. of the spec. The forest has a node for every
+  // position of the window, so forest_bits is window_bits, unless the whole
+  // stream is shorter than 1 << forest_bits minus 16 bytes.
+  void Init(uint32_t* forest, int forest_bits, int window_bits) {
+    forest_ = forest;
+    window_mask_ = (1u << forest_bits) - 1;
+    // Every position is further back than the window from invalid_pos_.
+    invalid_pos_ = 0u - ((1u << window_bits) - 1);
+  }
+
+  void Reset() {
+    std::fill(&buckets_[0], &buckets_[0] + kBucketSize, invalid_pos_);
+    first_ix_ = 0;
+  }
+
+  // Clears the hasher as if the stream started at position, so that no
+  // backward references to the data before it are found.
+  void ResetAt(size_t position) {
+    Reset();
+    first_ix_ = position;
+  }
+
+  // Returns the position where the hasher was last cleared.
+  size_t first_position() const { return first_ix_; }
+
+  // Clears the hasher before compressing a new stream. If one_shot is true,
+  // data holds the whole input_size bytes of the stream. For small inputs,
+  // only the buckets that can be looked up are cleared then, which makes the
+  // result the same as that of Reset() at a cost of O(input_size).
+  void Prepare(bool one_shot, size_t input_size, const uint8_t* data) {
+    if (one_shot && input_size <= (kBucketSize >> 6)) {
+      for (size_t i = 0; i + kHashTypeLength <= input_size; ++i) {
+        buckets_[HashBytes(&data[i])] = invalid_pos_;
+      }
+      first_ix_ = 0;
+    } else {
+      Reset();
+    }
+  }
+
+  // Inserts the position ix of the ring buffer into its tree. The
+  // kMaxTreeCompLength bytes from ix on have to be in the ring buffer.
+  void Store(const uint8_t* data, const size_t ring_buffer_mask,
+             const uint32_t ix) {
+    StoreAndFindMatches(data, ring_buffer_mask, ix, kMaxTreeCompLength,
+                        window_mask_ - 15, NULL, NULL);
+  }
+
+  // Inserts the positions from start to end (exclusive) into their trees.
+  void StoreRange(const uint8_t* data, const size_t ring_buffer_mask,
+                  const uint32_t start, const uint32_t end) {
+    for (uint32_t ix = start; ix < end; ++ix) {
+      Store(data, ring_buffer_mask, ix);
+    }
+  }
+
+  // Inserts the last kMaxTreeCompLength - 1 positions before the block of
+  // num_bytes bytes at position, which could not be inserted before, since
+  // their strings go on into this block. Those of them whose strings also
+  // go on after this block are left for the next one.
+  void StitchToPreviousBlock(size_t num_bytes, size_t position,
+                             const uint8_t* ring_buffer,
+                             size_t ring_buffer_mask) {
+    const size_t data_end = position + num_bytes;
+    if (data_end < kMaxTreeCompLength) {
+      return;
+    }
+    const size_t start =
+        position >= first_ix_ + kMaxTreeCompLength - 1 ?
+        position - kMaxTreeCompLength + 1 : first_ix_;
+    const size_t end = std::min(position, data_end - kMaxTreeCompLength + 1);
+    for (size_t ix = start; ix < end; ++ix) {
+      // The data further back than the window from the end of the previous
+      // block may be overwritten by now.
+      const size_t max_backward =
+          window_mask_ - std::max<size_t>(15, position - ix);
+      StoreAndFindMatches(ring_buffer, ring_buffer_mask, ix,
+                          kMaxTreeCompLength, max_backward, NULL, NULL);
+    }
+  }
+
+  // Finds all matches of &data[cur_ix & ring_buffer_mask] up to the length
+  // of max_length and inserts cur_ix into its tree, if max_length is at
+  // least kMaxTreeCompLength.
   //
   // Sets *num_matches to the number of matches found, and stores the found
-  // matches in matches[0] to matches[*num_matches - 1].
+  // matches in matches[0] to matches[*num_matches - 1], sorted by length.
   //
   // If the longest match is longer than kMaxZopfliLen, returns only this
   // longest match.
@@ -503,12 +712,16 @@ class HashLongestMatch {
                       uint32_t max_length,
                       const uint32_t max_backward,
                       int* num_matches,
-                      BackwardMatch* matches) const {
+                      BackwardMatch* matches) {
     BackwardMatch* const orig_matches = matches;
     const size_t cur_ix_masked = cur_ix & ring_buffer_mask;
     int best_len = 1;
+    // The trees only hold matches of at least four bytes, so shorter ones
+    // are looked for nearby.
     int stop = static_cast<int>(cur_ix) - 64;
-    if (stop < 0) { stop = 0; }
+    if (stop < static_cast<int>(first_ix_)) {
+      stop = static_cast<int>(first_ix_);
+    }
     for (int i = cur_ix - 1; i > stop && best_len <= 2; --i) {
       size_t prev_ix = i;
       const size_t backward = cur_ix - prev_ix;
@@ -520,46 +733,26 @@ class HashLongestMatch {
           data[cur_ix_masked + 1] != data[prev_ix + 1]) {
         continue;
       }
-      const size_t len =
+      const int len =
           FindMatchLengthWithLimit(&data[prev_ix], &data[cur_ix_masked],
                                    max_length);
       if (len > best_len) {
         best_len = len;
-        if (len > kMaxZopfliLen) {
-          matches = orig_matches;
-        }
         *matches++ = BackwardMatch(backward, len);
       }
     }
-    const uint32_t key = HashBytes(&data[cur_ix_masked]);
-    const int * __restrict const bucket = &buckets_[key][0];
-    const int down = (num_[key] > kBlockSize) ? (num_[key] - kBlockSize) : 0;
-    for (int i = num_[key] - 1; i >= down; --i) {
-      int prev_ix = bucket[i & kBlockMask];
-      if (prev_ix >= 0) {
-        const size_t backward = cur_ix - prev_ix;
-        if (PREDICT_FALSE(backward > max_backward)) {
-          break;
-        }
-        prev_ix &= ring_buffer_mask;
-        if (cur_ix_masked + best_len > ring_buffer_mask ||
-            prev_ix + best_len > ring_buffer_mask ||
-            data[cur_ix_masked + best_len] != data[prev_ix + best_len]) {
-          continue;
-        }
-        const size_t len =
-            FindMatchLengthWithLimit(&data[prev_ix], &data[cur_ix_masked],
-                                     max_length);
-        if (len > best_len) {
-          best_len = len;
-          if (len > kMaxZopfliLen) {
-            matches = orig_matches;
-          }
-          *matches++ = BackwardMatch(backward, len);
-        }
-      }
+    if (best_len < max_length) {
+      matches = StoreAndFindMatches(data, ring_buffer_mask, cur_ix,
+                                    max_length, max_backward, &best_len,
+                                    matches);
     }
-    std::vector<int> dict_matches(kMaxDictionaryMatchLen + 1, kInvalidMatch);
+    if (best_len > kMaxZopfliLen) {
+      orig_matches[0] = matches[-1];
+      matches = orig_matches + 1;
+    }
+    int dict_matches[kMaxDictionaryMatchLen + 1];
+    std::fill(dict_matches, dict_matches + kMaxDictionaryMatchLen + 1,
+              kInvalidMatch);
     int minlen = std::max<int>(4, best_len + 1);
     if (FindAllStaticDictionaryMatches(&data[cur_ix_masked], minlen, max_length,
                                        &dict_matches[0])) {
@@ -577,19 +770,10 @@ class HashLongestMatch {
 
   enum { kHashLength = 4 };
   enum { kHashTypeLength = 4 };
+  // Only this many bytes of the strings are compared to order the trees.
+  enum { kMaxTreeCompLength = 128 };
 
-  // HashBytes is the function that chooses the bucket to place
-  // the address in. The HashLongestMatch and HashLongestMatchQuickly
-  // classes have separate, different implementations of hashing.
   static uint32_t HashBytes(const uint8_t *data) {
-    // kHashMul32 multiplier has these properties:
-    // * The multiplier must be odd. Otherwise we may lose the highest bit.
-    // * No long streaks of 1s or 0s.
-    // * Is not unfortunate (see the unittest) for the English language.
-    // * There is no effort to ensure that it is a prime, the oddity is enough
-    //   for this use.
-    // * The number has been tuned heuristically against compression benchmarks.
-    static const uint32_t kHashMul32 = 0x1e35a7bd;
     uint32_t h = BROTLI_UNALIGNED_LOAD32(data) * kHashMul32;
     // The higher bits contain more mixture from the multiplication,
     // so we take our results from there.
@@ -600,23 +784,104 @@ class HashLongestMatch {
   // Number of hash buckets.
   static const uint32_t kBucketSize = 1 << kBucketBits;
 
-  // Only kBlockSize newest backward references are kept,
-  // and the older are forgotten.
-  static const uint32_t kBlockSize = 1 << kBlockBits;
+  // Number of nodes of a tree visited by a lookup at most.
+  static const int kMaxTreeSearchDepth = 64;
 
-  // Mask for accessing entries in a block (in a ringbuffer manner).
-  static const uint32_t kBlockMask = (1 << kBlockBits) - 1;
+  size_t LeftChildIndex(const size_t pos) const {
+    return 2 * (pos & window_mask_);
+  }
 
-  // Number of entries in a particular bucket.
-  uint16_t num_[kBucketSize];
+  size_t RightChildIndex(const size_t pos) const {
+    return 2 * (pos & window_mask_) + 1;
+  }
 
-  // Buckets containing kBlockSize of backward references.
-  int buckets_[kBucketSize][kBlockSize];
+  // Walks down the tree of the hash of the string at cur_ix. If matches is
+  // not NULL, the matches longer than *best_len found on the way are stored
+  // there in the order of their length, and *best_len is updated. If
+  // max_length is at least kMaxTreeCompLength, cur_ix becomes the root of
+  // the tree, and the nodes on the way become its subtrees. Returns the end
+  // of the stored matches.
+  BackwardMatch* StoreAndFindMatches(const uint8_t* const data,
+                                     const size_t ring_buffer_mask,
+                                     const size_t cur_ix,
+                                     const size_t max_length,
+                                     const size_t max_backward,
+                                     int* const best_len,
+                                     BackwardMatch* matches) {
+    const size_t cur_ix_masked = cur_ix & ring_buffer_mask;
+    const size_t max_comp_len =
+        std::min<size_t>(max_length, kMaxTreeCompLength);
+    const bool should_reroot_tree = max_length >= kMaxTreeCompLength;
+    const uint32_t key = HashBytes(&data[cur_ix_masked]);
+    size_t prev_ix = buckets_[key];
+    // The nodes where the left and right subtrees of cur_ix go, and the
+    // lengths of the matches that are known at the next nodes on the way.
+    size_t node_left = LeftChildIndex(cur_ix);
+    size_t node_right = RightChildIndex(cur_ix);
+    size_t best_len_left = 0;
+    size_t best_len_right = 0;
+    if (should_reroot_tree) {
+      buckets_[key] = static_cast<uint32_t>(cur_ix);
+    }
+    for (int depth_remaining = kMaxTreeSearchDepth; ; --depth_remaining) {
+      const size_t backward = static_cast<uint32_t>(cur_ix - prev_ix);
+      const size_t prev_ix_masked = prev_ix & ring_buffer_mask;
+      if (backward == 0 || backward > max_backward || depth_remaining == 0) {
+        if (should_reroot_tree) {
+          forest_[node_left] = invalid_pos_;
+          forest_[node_right] = invalid_pos_;
+        }
+        break;
+      }
+      const size_t cur_len = std::min(best_len_left, best_len_right);
+      const size_t len = cur_len +
+          FindMatchLengthWithLimit(&data[cur_ix_masked + cur_len],
+                                   &data[prev_ix_masked + cur_len],
+                                   max_length - cur_len);
+      if (matches && len > *best_len) {
+        *best_len = static_cast<int>(len);
+        *matches++ = BackwardMatch(static_cast<int>(backward),
+                                   static_cast<int>(len));
+      }
+      if (len >= max_comp_len) {
+        // The strings are equal as far as the trees are ordered, so the
+        // subtrees of prev_ix become those of cur_ix.
+        if (should_reroot_tree) {
+          forest_[node_left] = forest_[LeftChildIndex(prev_ix)];
+          forest_[node_right] = forest_[RightChildIndex(prev_ix)];
+        }
+        break;
+      }
+      if (data[cur_ix_masked + len] > data[prev_ix_masked + len]) {
+        best_len_left = len;
+        if (should_reroot_tree) {
+          forest_[node_left] = static_cast<uint32_t>(prev_ix);
+        }
+        node_left = RightChildIndex(prev_ix);
+        prev_ix = forest_[node_left];
+      } else {
+        best_len_right = len;
+        if (should_reroot_tree) {
+          forest_[node_right] = static_cast<uint32_t>(prev_ix);
+        }
+        node_right = LeftChildIndex(prev_ix);
+        prev_ix = forest_[node_right];
+      }
+    }
+    return matches;
+  }
 
-  size_t num_dict_lookups_;
-  size_t num_dict_matches_;
+  // The roots of the trees.
+  uint32_t buckets_[kBucketSize];
+  // The children of the nodes of the trees.
+  uint32_t* forest_;
+  uint32_t window_mask_;
+  uint32_t invalid_pos_;
+  // Position where the hasher was last cleared.
+  size_t first_ix_;
 };
 
+// The hashers are allocated with the given allocator.
 struct Hashers {
   // For kBucketSweep == 1, enabling the dictionary lookup makes compression
   // a little faster (0.5% - 1%) and it compresses 0.15% better on small text
@@ -630,18 +895,112 @@ struct Hashers {
   typedef HashLongestMatch<15, 6, 10> H7;
   typedef HashLongestMatch<15, 7, 10> H8;
   typedef HashLongestMatch<15, 8, 16> H9;
+  typedef HashToBinaryTree<17> H10;
+  // Types 15 to 19 are variants of types 5 to 9 with fewer buckets, for
+  // inputs of at most kMaxSmallHasherInputSize bytes. They are much cheaper
+  // to allocate and to clear, and on such inputs they compress about as well
+  // as the full-size hashers.
+  typedef HashLongestMatch<12, 4, 4> H15;
+  typedef HashLongestMatch<12, 5, 4> H16;
+  typedef HashLongestMatch<12, 6, 10> H17;
+  typedef HashLongestMatch<12, 7, 10> H18;
+  typedef HashLongestMatch<12, 8, 16> H19;
+
+  static const size_t kMaxSmallHasherInputSize = 1 << 16;
+
+  // Returns the hasher type to use at the given quality. Above quality 9,
+  // the zopflification finds all matches with the binary tree hasher.
+  static int HasherTypeForQuality(int quality) {
+    return quality > 9 ? 10 : quality;
+  }
+
+  // Returns the hasher type to use for a stream of the given type, if
+  // one_shot is true and the whole stream is input_size bytes long.
+  static int HasherTypeForInput(int type, bool one_shot, size_t input_size) {
+    if (one_shot && input_size <= kMaxSmallHasherInputSize &&
+        type >= 5 && type <= 9) {
+      return type + 10;
+    }
+    return type;
+  }
+
+  explicit Hashers(BrotliAllocator* allocator)
+      : allocator_(allocator), forest_bits_h10_(0) {}
+
+  // Allocates the hasher of the given type for a window of 1 << lgwin bytes,
+  // unless it already exists. The hasher has to be prepared with Prepare()
+  // before use. Returns false if the hasher could not be allocated.
+  bool Init(int type, int lgwin) {
+    return Init(type, lgwin, false, 0);
+  }
+
+  // Same as Init(type, lgwin), but if one_shot is true, the whole stream is
+  // input_size bytes long, and the binary tree hasher only gets a forest for
+  // that many positions, like the small hashers of HasherTypeForInput().
+  bool Init(int type, int lgwin, bool one_shot, size_t input_size) {
+    switch (type) {
+      case 1: return Init(&hash_h1);
+      case 2: return Init(&hash_h2);
+      case 3: return Init(&hash_h3);
+      case 4: return Init(&hash_h4);
+      case 5: return Init(&hash_h5);
+      case 6: return Init(&hash_h6);
+      case 7: return Init(&hash_h7);
+      case 8: return Init(&hash_h8);
+      case 9: return Init(&hash_h9);
+      case 10: return InitBinaryTree(lgwin, one_shot, input_size);
+      case 15: return Init(&hash_h15);
+      case 16: return Init(&hash_h16);
+      case 17: return Init(&hash_h17);
+      case 18: return Init(&hash_h18);
+      case 19: return Init(&hash_h19);
+      default: return true;
+    }
+  }
+
+  // Clears the hasher of the given type for a new stream, see Prepare() of
+  // the hasher classes.
+  void Prepare(int type, bool one_shot, size_t input_size,
+               const uint8_t* data) {
+    switch (type) {
+      case 1: hash_h1->Prepare(one_shot, input_size, data); break;
+      case 2: hash_h2->Prepare(one_shot, input_size, data); break;
+      case 3: hash_h3->Prepare(one_shot, input_size, data); break;
+      case 4: hash_h4->Prepare(one_shot, input_size, data); break;
+      case 5: hash_h5->Prepare(one_shot, input_size, data); break;
+      case 6: hash_h6->Prepare(one_shot, input_size, data); break;
+      case 7: hash_h7->Prepare(one_shot, input_size, data); break;
+      case 8: hash_h8->Prepare(one_shot, input_size, data); break;
+      case 9: hash_h9->Prepare(one_shot, input_size, data); break;
+      case 10: hash_h10->Prepare(one_shot, input_size, data); break;
+      case 15: hash_h15->Prepare(one_shot, input_size, data); break;
+      case 16: hash_h16->Prepare(one_shot, input_size, data); break;
+      case 17: hash_h17->Prepare(one_shot, input_size, data); break;
+      case 18: hash_h18->Prepare(one_shot, input_size, data); break;
+      case 19: hash_h19->Prepare(one_shot, input_size, data); break;
+      default: break;
+    }
+  }
 
-  void Init(int type) {
+  // Clears the hasher of the given type as if the stream started at
+  // position, see ResetAt() of the hasher classes.
+  void ResetAt(int type, size_t position) {
     switch (type) {
-      case 1: hash_h1.reset(new H1); break;
-      case 2: hash_h2.reset(new H2); break;
-      case 3: hash_h3.reset(new H3); break;
-      case 4: hash_h4.reset(new H4); break;
-      case 5: hash_h5.reset(new H5); break;
-      case 6: hash_h6.reset(new H6); break;
-      case 7: hash_h7.reset(new H7); break;
-      case 8: hash_h8.reset(new H8); break;
-      case 9: hash_h9.reset(new H9); break;
+      case 1: hash_h1->ResetAt(position); break;
+      case 2: hash_h2->ResetAt(position); break;
+      case 3: hash_h3->ResetAt(position); break;
+      case 4: hash_h4->ResetAt(position); break;
+      case 5: hash_h5->ResetAt(position); break;
+      case 6: hash_h6->ResetAt(position); break;
+      case 7: hash_h7->ResetAt(position); break;
+      case 8: hash_h8->ResetAt(position); break;
+      case 9: hash_h9->ResetAt(position); break;
+      case 10: hash_h10->ResetAt(position); break;
+      case 15: hash_h15->ResetAt(position); break;
+      case 16: hash_h16->ResetAt(position); break;
+      case 17: hash_h17->ResetAt(position); break;
+      case 18: hash_h18->ResetAt(position); break;
+      case 19: hash_h19->ResetAt(position); break;
       default: break;
     }
   }
@@ -649,7 +1008,7 @@ struct Hashers {
   template<typename Hasher>
   void WarmupHash(const size_t size, const uint8_t* dict, Hasher* hasher) {
     for (size_t i = 0; i + Hasher::kHashTypeLength - 1 < size; i++) {
-      hasher->Store(dict, i);
+      hasher->Store(&dict[i], i);
     }
   }
 
@@ -666,19 +1025,82 @@ struct Hashers {
       case 7: WarmupHash(size, dict, hash_h7.get()); break;
       case 8: WarmupHash(size, dict, hash_h8.get()); break;
       case 9: WarmupHash(size, dict, hash_h9.get()); break;
+      case 10:
+        // The last positions are inserted with the first block, see
+        // HashToBinaryTree::StitchToPreviousBlock().
+        if (size >= H10::kMaxTreeCompLength) {
+          hash_h10->StoreRange(dict, ~static_cast<size_t>(0), 0,
+                               size - H10::kMaxTreeCompLength + 1);
+        }
+        break;
+      case 15: WarmupHash(size, dict, hash_h15.get()); break;
+      case 16: WarmupHash(size, dict, hash_h16.get()); break;
+      case 17: WarmupHash(size, dict, hash_h17.get()); break;
+      case 18: WarmupHash(size, dict, hash_h18.get()); break;
+      case 19: WarmupHash(size, dict, hash_h19.get()); break;
       default: break;
     }
   }
 
-  std::unique_ptr<H1> hash_h1;
-  std::unique_ptr<H2> hash_h2;
-  std::unique_ptr<H3> hash_h3;
-  std::unique_ptr<H4> hash_h4;
-  std::unique_ptr<H5> hash_h5;
-  std::unique_ptr<H6> hash_h6;
-  std::unique_ptr<H7> hash_h7;
-  std::unique_ptr<H8> hash_h8;
-  std::unique_ptr<H9> hash_h9;
+  AllocatedPtr<H1> hash_h1;
+  AllocatedPtr<H2> hash_h2;
+  AllocatedPtr<H3> hash_h3;
+  AllocatedPtr<H4> hash_h4;
+  AllocatedPtr<H5> hash_h5;
+  AllocatedPtr<H6> hash_h6;
+  AllocatedPtr<H7> hash_h7;
+  AllocatedPtr<H8> hash_h8;
+  AllocatedPtr<H9> hash_h9;
+  AllocatedPtr<H10> hash_h10;
+  AllocatedPtr<H15> hash_h15;
+  AllocatedPtr<H16> hash_h16;
+  AllocatedPtr<H17> hash_h17;
+  AllocatedPtr<H18> hash_h18;
+  AllocatedPtr<H19> hash_h19;
+
+ private:
+  template<typename Hasher>
+  bool Init(AllocatedPtr<Hasher>* hasher) {
+    if (!*hasher) {
+      *hasher = AllocateObject<Hasher>(allocator_);
+    }
+    return static_cast<bool>(*hasher);
+  }
+
+  bool InitBinaryTree(int lgwin, bool one_shot, size_t input_size) {
+    if (!Init(&hash_h10)) {
+      return false;
+    }
+    int forest_bits = lgwin;
+    if (one_shot) {
+      forest_bits = kMinForestBits;
+      while (forest_bits < lgwin &&
+             (static_cast<size_t>(1) << forest_bits) < input_size + 16) {
+        ++forest_bits;
+      }
+    }
+    // A forest from a previous stream is reused if it is large enough.
+    if (forest_bits_h10_ < forest_bits) {
+      forest_h10_.reset();
+      forest_h10_ = AllocateArray<uint32_t>(allocator_, 2 << forest_bits);
+      if (!forest_h10_) {
+        forest_bits_h10_ = 0;
+        return false;
+      }
+      forest_bits_h10_ = forest_bits;
+    }
+    hash_h10->Init(forest_h10_.get(), std::min(forest_bits_h10_, lgwin),
+                   lgwin);
+    return true;
+  }
+
+  static const int kMinForestBits = 10;
+
+  BrotliAllocator* allocator_;
+  // The forest of the trees of hash_h10, for 1 << forest_bits_h10_
+  // positions.
+  AllocatedPtr<uint32_t[]> forest_h10_;
+  int forest_bits_h10_;
 };
 
 }  // namespace brotli
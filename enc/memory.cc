@@ -0,0 +1,110 @@
+// Copyright 2015 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Memory allocation interface of the encoder.
+
+#include "./memory.h"
+
+#include <stdlib.h>
+
+namespace brotli {
+
+namespace {
+
+class MallocAllocator : public BrotliAllocator {
+ public:
+  void* Allocate(size_t size) override {
+    return malloc(size);
+  }
+
+  void Free(void* p) override {
+    free(p);
+  }
+};
+
+// All arena allocations are aligned to this many bytes.
+static const size_t kArenaAlignment = 16;
+
+size_t AlignSize(size_t size) {
+  return (size + kArenaAlignment - 1) & ~(kArenaAlignment - 1);
+}
+
+}  // namespace
+
+BrotliAllocator* DefaultAllocator() {
+  static MallocAllocator allocator;
+  return &allocator;
+}
+
+MemoryArena::MemoryArena(BrotliAllocator* allocator)
+    : allocator_(allocator),
+      block_(NULL),
+      block_size_(0),
+      pos_(0),
+      overflow_(NULL),
+      overflow_size_(0) {}
+
+MemoryArena::~MemoryArena() {
+  Reset();
+  if (block_ != NULL) {
+    allocator_->Free(block_);
+  }
+}
+
+void* MemoryArena::AllocateBytes(size_t size) {
+  // Empty requests get memory too, since NULL means that allocation failed,
+  // and the main block does not exist before the first Reset().
+  size = AlignSize(size == 0 ? 1 : size);
+  if (size <= block_size_ - pos_) {
+    void* p = &block_[pos_];
+    pos_ += size;
+    return p;
+  }
+  // The main block is full, so the memory comes from a separate block until
+  // the next Reset() enlarges the main block.
+  const size_t header_size = AlignSize(sizeof(Overflow));
+  uint8_t* p = static_cast<uint8_t*>(allocator_->Allocate(header_size + size));
+  if (p == NULL) {
+    return NULL;
+  }
+  Overflow* overflow = reinterpret_cast<Overflow*>(p);
+  overflow->next = overflow_;
+  overflow->size = size;
+  overflow_ = overflow;
+  overflow_size_ += size;
+  return p + header_size;
+}
+
+void MemoryArena::Reset() {
+  pos_ = 0;
+  if (overflow_ == NULL) {
+    return;
+  }
+  while (overflow_ != NULL) {
+    Overflow* next = overflow_->next;
+    allocator_->Free(overflow_);
+    overflow_ = next;
+  }
+  // Make the main block large enough for everything that was allocated since
+  // the last Reset(), so that the next round fits into it.
+  const size_t new_size = block_size_ + overflow_size_;
+  overflow_size_ = 0;
+  if (block_ != NULL) {
+    allocator_->Free(block_);
+  }
+  block_ = static_cast<uint8_t*>(allocator_->Allocate(new_size));
+  block_size_ = block_ != NULL ? new_size : 0;
+}
+
+}  // namespace brotli
@@ -0,0 +1,128 @@
+// Copyright 2015 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Memory allocation interface of the encoder.
+
+#ifndef BROTLI_ENC_MEMORY_H_
+#define BROTLI_ENC_MEMORY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <new>
+
+namespace brotli {
+
+// Interface for the memory allocations of the compressor.
+class BrotliAllocator {
+ public:
+  virtual ~BrotliAllocator() {}
+
+  // Returns a pointer to size bytes of memory that is suitably aligned for
+  // any type, or NULL if the memory can not be allocated.
+  virtual void* Allocate(size_t size) = 0;
+
+  // Releases memory returned by Allocate().
+  virtual void Free(void* p) = 0;
+};
+
+// Returns the allocator that uses malloc() and free().
+BrotliAllocator* DefaultAllocator();
+
+// Deleter for std::unique_ptr that releases memory to a BrotliAllocator.
+// The destructor of the object is not called, so only types with trivial
+// destructors can be managed this way.
+class AllocatorDeleter {
+ public:
+  explicit AllocatorDeleter(BrotliAllocator* allocator = NULL)
+      : allocator_(allocator) {}
+
+  void operator()(void* p) const {
+    allocator_->Free(p);
+  }
+
+ private:
+  BrotliAllocator* allocator_;
+};
+
+template<typename T>
+using AllocatedPtr = std::unique_ptr<T, AllocatorDeleter>;
+
+// Allocates and default-constructs an object of type T with the given
+// allocator. Returns an empty pointer if the allocation failed.
+template<typename T>
+AllocatedPtr<T> AllocateObject(BrotliAllocator* allocator) {
+  void* p = allocator->Allocate(sizeof(T));
+  if (p == NULL) {
+    return AllocatedPtr<T>();
+  }
+  return AllocatedPtr<T>(new (p) T, AllocatorDeleter(allocator));
+}
+
+// Allocates and default-constructs an array of n objects of type T with the
+// given allocator. Returns an empty pointer if the allocation failed.
+template<typename T>
+AllocatedPtr<T[]> AllocateArray(BrotliAllocator* allocator, size_t n) {
+  T* p = static_cast<T*>(allocator->Allocate(n * sizeof(T)));
+  if (p == NULL) {
+    return AllocatedPtr<T[]>();
+  }
+  for (size_t i = 0; i < n; ++i) {
+    new (&p[i]) T;
+  }
+  return AllocatedPtr<T[]>(p, AllocatorDeleter(allocator));
+}
+
+// Bump-pointer allocator for the temporary memory of a meta-block. All
+// memory allocated from the arena is released at once with Reset(), which
+// keeps the memory for reuse, so that once the arena is large enough for a
+// meta-block, compressing further meta-blocks does not allocate any memory.
+class MemoryArena {
+ public:
+  explicit MemoryArena(BrotliAllocator* allocator);
+  ~MemoryArena();
+
+  // Returns uninitialized memory for n objects of type T, or NULL if the
+  // memory can not be allocated. The memory is valid until Reset().
+  template<typename T>
+  T* Allocate(size_t n) {
+    return static_cast<T*>(AllocateBytes(n * sizeof(T)));
+  }
+
+  void* AllocateBytes(size_t size);
+
+  // Releases all memory allocated since the last Reset().
+  void Reset();
+
+ private:
+  // Header of a memory block that did not fit into the main block.
+  struct Overflow {
+    Overflow* next;
+    size_t size;
+  };
+
+  MemoryArena(const MemoryArena&);
+  void operator=(const MemoryArena&);
+
+  BrotliAllocator* allocator_;
+  uint8_t* block_;
+  size_t block_size_;
+  size_t pos_;
+  Overflow* overflow_;
+  size_t overflow_size_;
+};
+
+}  // namespace brotli
+
+#endif  // BROTLI_ENC_MEMORY_H_
@@ -20,6 +20,7 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "./memory.h"
 #include "./port.h"
 
 namespace brotli {
@@ -29,23 +30,25 @@ namespace brotli {
 // `position() % (1 << window_bits)'. For convenience, the RingBuffer array
 // contains another copy of the first `1 << tail_bits' bytes:
 // buffer_[i] == buffer_[i + (1 << window_bits)] if i < (1 << tail_bits).
+// The array is allocated with the given allocator; if that fails, start()
+// returns NULL and the ring buffer must not be written.
 class RingBuffer {
  public:
-  RingBuffer(int window_bits, int tail_bits)
+  RingBuffer(int window_bits, int tail_bits, BrotliAllocator* allocator)
       : window_bits_(window_bits),
         mask_((1 << window_bits) - 1),
         tail_size_(1 << tail_bits),
         pos_(0) {
     static const int kSlackForEightByteHashingEverywhere = 7;
     const int buflen = (1 << window_bits_) + tail_size_;
-    buffer_ = new uint8_t[buflen + kSlackForEightByteHashingEverywhere];
-    for (int i = 0; i < kSlackForEightByteHashingEverywhere; ++i) {
-      buffer_[buflen + i] = 0;
+    buffer_ = AllocateArray<uint8_t>(
+        allocator, buflen + kSlackForEightByteHashingEverywhere);
+    if (buffer_) {
+      for (int i = 0; i < kSlackForEightByteHashingEverywhere; ++i) {
+        buffer_[buflen + i] = 0;
+      }
     }
   }
-  ~RingBuffer() {
-    delete [] buffer_;
-  }
 
   // Push bytes into the ring buffer.
   void Write(const uint8_t *bytes, size_t n) {
@@ -78,8 +81,8 @@ class RingBuffer {
   // Bit mask for getting the physical position for a logical position.
   size_t mask() const { return mask_; }
 
-  uint8_t *start() { return &buffer_[0]; }
-  const uint8_t *start() const { return &buffer_[0]; }
+  uint8_t *start() { return buffer_.get(); }
+  const uint8_t *start() const { return buffer_.get(); }
 
  private:
   void WriteTail(const uint8_t *bytes, size_t n) {
@@ -100,7 +103,7 @@ class RingBuffer {
   size_t pos_;
   // The actual ring buffer containing the data and the copy of the beginning
   // as a tail.
-  uint8_t *buffer_;
+  AllocatedPtr<uint8_t[]> buffer_;
 };
 
 }  // namespace brotli
@@ -123,5 +123,9 @@ bool BrotliFileOut::Write(const void* buf, size_t n) {
   return true;
 }
 
+bool BrotliInIsFinished(BrotliIn* r) {
+  size_t read_bytes;
+  return r->Read(0, &read_bytes) == NULL;
+}
 
 }  // namespace brotli
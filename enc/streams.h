@@ -18,6 +18,7 @@
 #define BROTLI_ENC_STREAMS_H_
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string>
 
@@ -36,6 +37,30 @@ class BrotliIn {
   virtual const void* Read(size_t n, size_t* nread) = 0;
 };
 
+// Reads input from r until block_size bytes are read or an EOF (NULL) is
+// received, calls sink(data, n) for each of the pieces of n bytes that r
+// returns, and returns the number of bytes read. This is useful to get
+// deterministic compressed output for the same input no matter how r->Read
+// splits the input to chunks.
+template<typename Sink>
+size_t ReadInputBlock(BrotliIn* r, size_t block_size, Sink sink) {
+  size_t bytes_read = 0;
+  while (bytes_read < block_size) {
+    size_t n = 0;
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(
+        r->Read(block_size - bytes_read, &n));
+    if (data == NULL) {
+      break;
+    }
+    sink(data, n);
+    bytes_read += n;
+  }
+  return bytes_read;
+}
+
+// Returns true if r has no more input.
+bool BrotliInIsFinished(BrotliIn* r);
+
 // Output interface for the compression routines.
 class BrotliOut {
  public:
@@ -141,11 +141,13 @@ brotli = Extension("brotli",
                         "enc/entropy_encode.cc",
                         "enc/histogram.cc",
                         "enc/literal_cost.cc",
+                        "enc/memory.cc",
                         "enc/metablock.cc",
                         "enc/static_dict.cc",
                         "enc/streams.cc",
                         "dec/bit_reader.c",
                         "dec/decode.c",
+                        "dec/decode_parallel.c",
                         "dec/dictionary.c",
                         "dec/huffman.c",
                         "dec/streams.c",
@@ -168,6 +170,7 @@ brotli = Extension("brotli",
                         "enc/hash.h",
                         "enc/histogram.h",
                         "enc/literal_cost.h",
+                        "enc/memory.h",
                         "enc/metablock.h",
                         "enc/port.h",
                         "enc/prefix.h",
@@ -180,6 +183,7 @@ brotli = Extension("brotli",
                         "dec/bit_reader.h",
                         "dec/context.h",
                         "dec/decode.h",
+                        "dec/decode_parallel.h",
                         "dec/dictionary.h",
                         "dec/huffman.h",
                         "dec/prefix.h",
@@ -188,6 +192,7 @@ brotli = Extension("brotli",
                         "dec/transform.h",
                         "dec/types.h",
                         "dec/state.h",
+                        "dec/seek_index.h",
                     ],
                     language="c++",
                     )
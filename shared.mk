@@ -15,4 +15,5 @@ else
 endif
 
 CFLAGS += $(COMMON_FLAGS)
-CXXFLAGS += $(COMMON_FLAGS) -std=c++11
+CXXFLAGS += $(COMMON_FLAGS) -std=c++11 -pthread
+LFLAGS += -pthread
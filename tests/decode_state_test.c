@@ -0,0 +1,258 @@
+/* Copyright 2015 Google Inc. All Rights Reserved.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+   Tests of the decoder state with a fixed arena, of decoding into small
+   output buffers, and of decoding several streams with one state that is
+   reset between them.
+
+   Usage: decode_state_test FILE.compressed...
+   The decompressed data of each FILE.compressed has to be in FILE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../dec/decode.h"
+#include "../dec/state.h"
+
+/* Enough for the largest window, see BrotliStateInitWithArena. */
+static const size_t kArenaSize = 32 << 20;
+/* Too small for the Huffman tables of most meta-blocks. */
+static const size_t kSmallArenaSize = 4 << 10;
+
+typedef struct {
+  const char* name;
+  uint8_t* compressed;
+  size_t compressed_size;
+  uint8_t* expected;
+  size_t expected_size;
+} TestFile;
+
+static uint8_t* ReadFile(const char* path, size_t* size) {
+  FILE* f = fopen(path, "rb");
+  uint8_t* data;
+  long n;
+  if (f == NULL || fseek(f, 0, SEEK_END) != 0 || (n = ftell(f)) < 0) {
+    fprintf(stderr, "Cannot read %s\n", path);
+    exit(1);
+  }
+  rewind(f);
+  /* One more byte, so that empty files get a buffer too. */
+  data = (uint8_t*)malloc((size_t)n + 1);
+  if (data == NULL || fread(data, 1, (size_t)n, f) != (size_t)n) {
+    fprintf(stderr, "Cannot read %s\n", path);
+    exit(1);
+  }
+  fclose(f);
+  *size = (size_t)n;
+  return data;
+}
+
+static void ReadTestFile(const char* path, TestFile* file) {
+  const char* suffix = strstr(path, ".compressed");
+  char* expected_path;
+  if (suffix == NULL) {
+    fprintf(stderr, "%s is not a .compressed file\n", path);
+    exit(1);
+  }
+  expected_path = (char*)malloc((size_t)(suffix - path) + 1);
+  memcpy(expected_path, path, (size_t)(suffix - path));
+  expected_path[suffix - path] = 0;
+  file->name = path;
+  file->compressed = ReadFile(path, &file->compressed_size);
+  file->expected = ReadFile(expected_path, &file->expected_size);
+  free(expected_path);
+}
+
+/* Decompresses the file with the given state into output, which has room for
+   one more byte than the expected data, and returns the result of the
+   decoder, or BROTLI_RESULT_NEEDS_MORE_OUTPUT if the output is not the
+   expected data. */
+static BrotliResult Decompress(const TestFile* file, BrotliState* s,
+                               uint8_t* output) {
+  BrotliMemInput memin;
+  BrotliMemOutput memout;
+  BrotliInput in = BrotliInitMemInput(file->compressed,
+                                      file->compressed_size, &memin);
+  BrotliOutput out = BrotliInitMemOutput(output, file->expected_size + 1,
+                                         &memout);
+  BrotliResult result = BrotliDecompressStreaming(in, out, 1, s);
+  if (result == BROTLI_RESULT_SUCCESS &&
+      (memout.pos != file->expected_size ||
+       memcmp(output, file->expected, file->expected_size) != 0)) {
+    return BROTLI_RESULT_NEEDS_MORE_OUTPUT;
+  }
+  return result;
+}
+
+/* Decompresses every file with a state that takes its memory from an arena
+   of arena_size bytes. Returns the number of files that failed to decode, or
+   -1 if a file decoded to the wrong data. */
+static int TestArena(const TestFile* files, int num_files, size_t arena_size,
+                     uint8_t* output) {
+  void* arena = malloc(arena_size);
+  int num_failed = 0;
+  int i;
+  for (i = 0; i < num_files; ++i) {
+    BrotliState s;
+    BrotliResult result;
+    BrotliStateInitWithArena(&s, arena, arena_size);
+    result = Decompress(&files[i], &s, output);
+    BrotliStateCleanup(&s);
+    if (result == BROTLI_RESULT_ERROR) {
+      ++num_failed;
+    } else if (result != BROTLI_RESULT_SUCCESS) {
+      fprintf(stderr, "%s: wrong output with a %lu byte arena\n",
+              files[i].name, (unsigned long)arena_size);
+      num_failed = -1;
+      break;
+    }
+  }
+  free(arena);
+  return num_failed;
+}
+
+/* Decompresses every file with BrotliDecompressBufferStreaming into an
+   output buffer of chunk_size bytes, which is drained into output after each
+   call. Returns 1 on success, 0 on failure. */
+static int TestSmallOutput(const TestFile* files, int num_files,
+                           size_t chunk_size, uint8_t* output) {
+  uint8_t* chunk = (uint8_t*)malloc(chunk_size);
+  int ok = 1;
+  int i;
+  for (i = 0; ok && i < num_files; ++i) {
+    const TestFile* file = &files[i];
+    const uint8_t* next_in = file->compressed;
+    size_t available_in = file->compressed_size;
+    size_t total_out = 0;
+    size_t pos = 0;
+    BrotliState s;
+    BrotliResult result;
+    BrotliStateInit(&s);
+    do {
+      uint8_t* next_out = chunk;
+      size_t available_out = chunk_size;
+      size_t n;
+      result = BrotliDecompressBufferStreaming(&available_in, &next_in, 1,
+                                               &available_out, &next_out,
+                                               &total_out, &s);
+      n = chunk_size - available_out;
+      if (n > file->expected_size - pos) {
+        ok = 0;
+        break;
+      }
+      memcpy(output + pos, chunk, n);
+      pos += n;
+    } while (result == BROTLI_RESULT_NEEDS_MORE_OUTPUT);
+    BrotliStateCleanup(&s);
+    if (!ok || result != BROTLI_RESULT_SUCCESS ||
+        pos != file->expected_size || total_out != pos ||
+        memcmp(output, file->expected, pos) != 0) {
+      fprintf(stderr, "%s: wrong output with %lu byte output chunks\n",
+              file->name, (unsigned long)chunk_size);
+      ok = 0;
+    }
+  }
+  free(chunk);
+  return ok;
+}
+
+/* Decompresses all files twice in a row with one state that is reset with
+   BrotliStateReset after each of them, so that the next stream reuses the
+   memory of a larger or a smaller one. If arena is not NULL, the state takes
+   its memory from it. Returns 1 on success, 0 on failure. */
+static int TestReset(const TestFile* files, int num_files, void* arena,
+                     size_t arena_size, uint8_t* output) {
+  BrotliState s;
+  int ok = 1;
+  int i;
+  if (arena != NULL) {
+    BrotliStateInitWithArena(&s, arena, arena_size);
+  } else {
+    BrotliStateInit(&s);
+  }
+  for (i = 0; i < 2 * num_files; ++i) {
+    const TestFile* file = &files[i % num_files];
+    if (Decompress(file, &s, output) != BROTLI_RESULT_SUCCESS) {
+      fprintf(stderr, "%s: decompression failed after BrotliStateReset\n",
+              file->name);
+      ok = 0;
+      break;
+    }
+    BrotliStateReset(&s);
+  }
+  BrotliStateCleanup(&s);
+  return ok;
+}
+
+int main(int argc, char** argv) {
+  int num_files = argc - 1;
+  TestFile* files = (TestFile*)malloc(sizeof(TestFile) * (size_t)argc);
+  size_t max_expected_size = 0;
+  uint8_t* output;
+  void* arena;
+  int num_failed;
+  int i;
+  for (i = 0; i < num_files; ++i) {
+    ReadTestFile(argv[i + 1], &files[i]);
+    if (files[i].expected_size > max_expected_size) {
+      max_expected_size = files[i].expected_size;
+    }
+  }
+  output = (uint8_t*)malloc(max_expected_size + 1);
+
+  printf("Testing decompression with an arena\n");
+  if (TestArena(files, num_files, kArenaSize, output) != 0) {
+    fprintf(stderr, "Decompression with an arena failed\n");
+    return 1;
+  }
+
+  printf("Testing decompression with an arena that is too small\n");
+  num_failed = TestArena(files, num_files, kSmallArenaSize, output);
+  if (num_failed <= 0) {
+    fprintf(stderr, "Decompression with a small arena did not fail\n");
+    return 1;
+  }
+
+  printf("Testing decompression into 1 byte output chunks\n");
+  if (!TestSmallOutput(files, num_files, 1, output)) {
+    return 1;
+  }
+
+  printf("Testing decompression into 16 KB output chunks\n");
+  if (!TestSmallOutput(files, num_files, 16 << 10, output)) {
+    return 1;
+  }
+
+  printf("Testing decompression of several streams with one state\n");
+  if (!TestReset(files, num_files, NULL, 0, output)) {
+    return 1;
+  }
+
+  printf("Testing decompression of several streams with one arena\n");
+  arena = malloc(kArenaSize);
+  if (!TestReset(files, num_files, arena, kArenaSize, output)) {
+    return 1;
+  }
+  free(arena);
+
+  for (i = 0; i < num_files; ++i) {
+    free(files[i].compressed);
+    free(files[i].expected);
+  }
+  free(files);
+  free(output);
+  return 0;
+}
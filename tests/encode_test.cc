@@ -0,0 +1,223 @@
+// Copyright 2015 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Tests of reusing a BrotliCompressor for several streams with Reset(), and
+// of compressing with a custom BrotliAllocator that may fail.
+//
+// Usage: encode_test FILE...
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+
+#include "../dec/decode.h"
+#include "../enc/encode.h"
+
+namespace {
+
+const int kQualities[] = { 1, 6, 9, 11 };
+
+// Allocator that keeps track of the memory blocks that are not freed yet,
+// and fails the allocation with the index fail_at, if it is not negative.
+class TestAllocator : public brotli::BrotliAllocator {
+ public:
+  explicit TestAllocator(int fail_at)
+      : fail_at_(fail_at), num_allocations_(0), num_blocks_(0) {}
+
+  void* Allocate(size_t size) override {
+    if (num_allocations_++ == fail_at_) {
+      return NULL;
+    }
+    void* p = malloc(size);
+    if (p != NULL) {
+      ++num_blocks_;
+    }
+    return p;
+  }
+
+  void Free(void* p) override {
+    if (p != NULL) {
+      --num_blocks_;
+      free(p);
+    }
+  }
+
+  int num_allocations() const { return num_allocations_; }
+  int num_blocks() const { return num_blocks_; }
+
+ private:
+  const int fail_at_;
+  int num_allocations_;
+  int num_blocks_;
+};
+
+bool ReadFile(const char* path, std::vector<uint8_t>* data) {
+  FILE* f = fopen(path, "rb");
+  if (f == NULL) {
+    return false;
+  }
+  uint8_t buffer[1 << 16];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    data->insert(data->end(), buffer, buffer + n);
+  }
+  fclose(f);
+  return true;
+}
+
+// Compresses input into a new stream with the given compressor.
+bool Compress(const std::vector<uint8_t>& input,
+              brotli::BrotliCompressor* compressor,
+              std::vector<uint8_t>* output) {
+  output->clear();
+  size_t pos = 0;
+  bool is_last = false;
+  while (!is_last) {
+    const size_t n =
+        std::min(input.size() - pos, compressor->input_block_size());
+    compressor->CopyInputToRingBuffer(n, input.data() + pos);
+    pos += n;
+    is_last = pos == input.size();
+    size_t out_size = 0;
+    uint8_t* out;
+    if (!compressor->WriteBrotliData(is_last, /* force_flush = */ false,
+                                     &out_size, &out)) {
+      return false;
+    }
+    output->insert(output->end(), out, out + out_size);
+  }
+  return true;
+}
+
+bool DecompressesTo(const std::vector<uint8_t>& compressed,
+                    const std::vector<uint8_t>& expected) {
+  std::vector<uint8_t> output(expected.size() + 1);
+  size_t output_size = output.size();
+  return BrotliDecompressBuffer(compressed.size(), compressed.data(),
+                                &output_size, &output[0]) ==
+      BROTLI_RESULT_SUCCESS &&
+      output_size == expected.size() &&
+      std::equal(expected.begin(), expected.end(), output.begin());
+}
+
+// Compresses all inputs twice in a row with one compressor that is reset
+// after each of them, so that the streams reuse the buffers of larger and
+// smaller ones, and checks that the output is the same as that of a new
+// compressor.
+bool TestReset(const std::vector<std::vector<uint8_t> >& inputs,
+               int quality) {
+  brotli::BrotliParams params;
+  params.quality = quality;
+  brotli::BrotliCompressor compressor(params);
+  for (size_t i = 0; i < 2 * inputs.size(); ++i) {
+    const std::vector<uint8_t>& input = inputs[i % inputs.size()];
+    std::vector<uint8_t> expected;
+    std::vector<uint8_t> output;
+    brotli::BrotliCompressor new_compressor(params);
+    if (!Compress(input, &new_compressor, &expected) ||
+        !Compress(input, &compressor, &output) ||
+        output != expected || !DecompressesTo(output, input)) {
+      fprintf(stderr, "Input %d at quality %d differs after Reset()\n",
+              static_cast<int>(i % inputs.size()), quality);
+      return false;
+    }
+    compressor.Reset();
+  }
+  return true;
+}
+
+// Compresses the input with a compressor that allocates its memory with
+// allocator. Returns false if compression failed or the compressor did not
+// free all its memory, and sets *ok to whether compression succeeded.
+bool CompressWithAllocator(const std::vector<uint8_t>& input, int quality,
+                           TestAllocator* allocator,
+                           std::vector<uint8_t>* output, bool* ok) {
+  brotli::BrotliParams params;
+  params.quality = quality;
+  params.allocator = allocator;
+  {
+    brotli::BrotliCompressor compressor(params);
+    *ok = Compress(input, &compressor, output);
+  }
+  return allocator->num_blocks() == 0;
+}
+
+// Compresses the input with an allocator that does not fail, and then with
+// allocators that fail each of the allocations of that run in turn. Each
+// run has to either fail, or give the same output as the one without
+// failures. The memory has to be freed in either case.
+bool TestAllocators(const std::vector<uint8_t>& input, int quality) {
+  std::vector<uint8_t> expected;
+  brotli::BrotliParams params;
+  params.quality = quality;
+  brotli::BrotliCompressor compressor(params);
+  if (!Compress(input, &compressor, &expected)) {
+    return false;
+  }
+  TestAllocator allocator(-1);
+  std::vector<uint8_t> output;
+  bool ok;
+  if (!CompressWithAllocator(input, quality, &allocator, &output, &ok) ||
+      !ok || output != expected || allocator.num_allocations() == 0) {
+    fprintf(stderr, "Compression with an allocator failed at quality %d\n",
+            quality);
+    return false;
+  }
+  int num_failed = 0;
+  for (int i = 0; i < allocator.num_allocations(); ++i) {
+    TestAllocator failing_allocator(i);
+    if (!CompressWithAllocator(input, quality, &failing_allocator, &output,
+                               &ok) ||
+        (ok && output != expected)) {
+      fprintf(stderr, "Allocation %d failed wrongly at quality %d\n",
+              i, quality);
+      return false;
+    }
+    num_failed += !ok;
+  }
+  if (num_failed == 0) {
+    fprintf(stderr, "No allocation failure failed at quality %d\n",
+            quality);
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::vector<std::vector<uint8_t> > inputs(argc - 1);
+  for (int i = 1; i < argc; ++i) {
+    if (!ReadFile(argv[i], &inputs[i - 1])) {
+      fprintf(stderr, "Cannot read %s\n", argv[i]);
+      return 1;
+    }
+  }
+  for (int quality : kQualities) {
+    printf("Testing compressor reuse at quality %d\n", quality);
+    if (!TestReset(inputs, quality)) {
+      return 1;
+    }
+  }
+  for (int quality : kQualities) {
+    printf("Testing allocators at quality %d\n", quality);
+    for (const std::vector<uint8_t>& input : inputs) {
+      if (!TestAllocators(input, quality)) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
@@ -27,5 +27,36 @@ for file in $INPUTS; do
     # Test the streaming version
     cat $file | $BRO -q $quality | $BRO -d >$uncompressed
     diff -q $file $uncompressed
+    # Test the multi-threaded version
+    cat $file | $BRO -q $quality --threads 3 --block-bits 16 | \
+      $BRO -d >$uncompressed
+    diff -q $file $uncompressed
+    # Test the seekable version and decompressing a range of it
+    $BRO -f -q $quality --seek-bits 16 -i $file -o $compressed
+    $BRO -f -d -i $compressed -o $uncompressed
+    diff -q $file $uncompressed
+    $BRO -d --threads 3 -i $compressed >$uncompressed
+    diff -q $file $uncompressed
+    $BRO -d --offset 70000 --length 1000 -i $compressed >$uncompressed
+    tail -c +70001 $file | head -c 1000 | cmp - $uncompressed
   done
+  echo "Roundtrip testing $file with more zopfli iterations"
+  $BRO -f -q 11 --zopfli-iterations 4 -i $file -o $compressed
+  $BRO -f -d -i $compressed -o $uncompressed
+  diff -q $file $uncompressed
 done
+
+echo "Roundtrip testing data that ends like a seek index"
+file=testdata/random_org_10k.bin
+fake_index=${file}.fake_index
+compressed=${fake_index}.bro
+uncompressed=${fake_index}.unbro
+# Incompressible data is stored in an uncompressed meta-block, so the stream
+# ends with the magic bytes of a seek index with no seek points.
+(cat $file; printf '\x05\0\0\0\0\0\0\0\0\0\0\0BrSk') >$fake_index
+$BRO -f -q 5 -i $fake_index -o $compressed
+$BRO -d --threads 2 -i $compressed >$uncompressed
+diff -q $fake_index $uncompressed
+$BRO -d --offset 0 --length 100 -i $compressed >$uncompressed
+head -c 100 $fake_index | cmp - $uncompressed
+rm -f $fake_index $compressed $uncompressed
@@ -17,14 +17,19 @@
 
 #include <fcntl.h>
 #include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <new>
 #include <string>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <time.h>
 #include <unistd.h>
+#include <vector>
 
 #include "../dec/decode.h"
+#include "../dec/decode_parallel.h"
 #include "../enc/encode.h"
+#include "../enc/encode_parallel.h"
 #include "../enc/streams.h"
 
 
@@ -40,6 +45,99 @@ static bool ParseQuality(const char* s, int* quality) {
   return false;
 }
 
+static bool ParseSize(const char* s, int64_t* size) {
+  *size = 0;
+  for (; *s >= '0' && *s <= '9'; ++s) {
+    if (*size > (INT64_MAX - 9) / 10) {
+      return false;
+    }
+    *size = *size * 10 + *s - '0';
+  }
+  return *s == 0;
+}
+
+static void ReadAll(FILE* fin, std::vector<uint8_t>* input) {
+  uint8_t buffer[1 << 16];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), fin)) > 0) {
+    input->insert(input->end(), buffer, buffer + n);
+  }
+}
+
+// Decompresses the given range of the output of the stream in fin into fout.
+// The range is decompressed in chunks, so that a length past the end of the
+// stream does not need a buffer of that size.
+static bool DecompressRange(FILE* fin, FILE* fout,
+                            int64_t offset, int64_t length) {
+  static const size_t kChunkSize = 1 << 24;
+  std::vector<uint8_t> input;
+  ReadAll(fin, &input);
+  if (input.empty()) {
+    return false;
+  }
+  size_t total_size;
+  if (BrotliDecompressedSize(input.size(), &input[0], &total_size)) {
+    length = static_cast<uint64_t>(offset) < total_size ?
+        std::min<uint64_t>(length, total_size - offset) : 0;
+  }
+  std::vector<uint8_t> output(
+      std::min<uint64_t>(length, kChunkSize) + 1);
+  int is_end;
+  do {
+    size_t decoded_size = std::min<uint64_t>(length, kChunkSize);
+    if (BrotliDecompressRange(input.size(), &input[0], offset,
+                              &decoded_size, &output[0], &is_end) !=
+            BROTLI_RESULT_SUCCESS ||
+        fwrite(output.data(), 1, decoded_size, fout) != decoded_size) {
+      return false;
+    }
+    offset += decoded_size;
+    length -= decoded_size;
+  } while (!is_end && length > 0);
+  return true;
+}
+
+// Allocates the output buffer of DecompressParallel, returns false if the
+// decompressed size given by the seek index does not fit in memory.
+static bool AllocateOutput(size_t decoded_size, std::vector<uint8_t>* output) {
+  if (decoded_size >= output->max_size()) {
+    return false;
+  }
+  try {
+    output->resize(decoded_size + 1);
+  } catch (const std::bad_alloc&) {
+    return false;
+  }
+  return true;
+}
+
+// Decompresses the stream in fin into fout. If it has a seek index, its
+// parts are decompressed on up to num_threads threads.
+static bool DecompressParallel(FILE* fin, FILE* fout, int num_threads) {
+  std::vector<uint8_t> input;
+  ReadAll(fin, &input);
+  size_t decoded_size;
+  if (input.empty()) {
+    return false;
+  }
+  std::vector<uint8_t> output;
+  if (!BrotliDecompressedSize(input.size(), &input[0], &decoded_size) ||
+      !AllocateOutput(decoded_size, &output)) {
+    // Without a buffer for the whole output, the stream is decompressed
+    // serially, which also finds out whether a huge size is corrupt.
+    BrotliMemInput memin;
+    BrotliInput in = BrotliInitMemInput(&input[0], input.size(), &memin);
+    return BrotliDecompress(in, BrotliFileOutput(fout)) ==
+        BROTLI_RESULT_SUCCESS;
+  }
+  if (BrotliDecompressBufferParallel(input.size(), &input[0], num_threads,
+                                     &decoded_size, &output[0]) !=
+      BROTLI_RESULT_SUCCESS) {
+    return false;
+  }
+  return fwrite(output.data(), 1, decoded_size, fout) == decoded_size;
+}
+
 static void ParseArgv(int argc, char **argv,
                       char **input_path,
                       char **output_path,
@@ -47,12 +145,24 @@ static void ParseArgv(int argc, char **argv,
                       int *quality,
                       int *decompress,
                       int *repeat,
-                      int *verbose) {
+                      int *verbose,
+                      int *threads,
+                      int *block_bits,
+                      int *seek_bits,
+                      int *zopfli_iterations,
+                      int64_t *offset,
+                      int64_t *length) {
   *force = 0;
   *input_path = 0;
   *output_path = 0;
   *repeat = 1;
   *verbose = 0;
+  *threads = 0;
+  *block_bits = 0;
+  *seek_bits = 0;
+  *zopfli_iterations = 0;
+  *offset = -1;
+  *length = -1;
   {
     size_t argv0_len = strlen(argv[0]);
     *decompress =
@@ -112,6 +222,48 @@ static void ParseArgv(int argc, char **argv,
         }
         ++k;
         continue;
+      } else if (!strcmp("--threads", argv[k]) ||
+                 !strcmp("-t", argv[k])) {
+        if (!ParseQuality(argv[k + 1], threads) || *threads < 1) {
+          goto error;
+        }
+        ++k;
+        continue;
+      } else if (!strcmp("--block-bits", argv[k]) ||
+                 !strcmp("-b", argv[k])) {
+        if (!ParseQuality(argv[k + 1], block_bits) ||
+            *block_bits < brotli::kMinInputBlockBits ||
+            *block_bits > brotli::kMaxInputBlockBits) {
+          goto error;
+        }
+        ++k;
+        continue;
+      } else if (!strcmp("--seek-bits", argv[k])) {
+        if (!ParseQuality(argv[k + 1], seek_bits) ||
+            *seek_bits < brotli::kMinInputBlockBits || *seek_bits > 30) {
+          goto error;
+        }
+        ++k;
+        continue;
+      } else if (!strcmp("--zopfli-iterations", argv[k])) {
+        if (!ParseQuality(argv[k + 1], zopfli_iterations) ||
+            *zopfli_iterations < 1) {
+          goto error;
+        }
+        ++k;
+        continue;
+      } else if (!strcmp("--offset", argv[k])) {
+        if (*offset >= 0 || !ParseSize(argv[k + 1], offset)) {
+          goto error;
+        }
+        ++k;
+        continue;
+      } else if (!strcmp("--length", argv[k])) {
+        if (*length >= 0 || !ParseSize(argv[k + 1], length)) {
+          goto error;
+        }
+        ++k;
+        continue;
       }
     }
     goto error;
@@ -121,7 +273,9 @@ error:
   fprintf(stderr,
           "Usage: %s [--force] [--quality n] [--decompress]"
           " [--input filename] [--output filename] [--repeat iters]"
-          " [--verbose]\n",
+          " [--threads n] [--block-bits n] [--seek-bits n]"
+          " [--zopfli-iterations n]"
+          " [--offset n --length n] [--verbose]\n",
           argv[0]);
   exit(1);
 }
@@ -177,13 +331,41 @@ int main(int argc, char** argv) {
   int decompress = 0;
   int repeat = 1;
   int verbose = 0;
+  int threads = 0;
+  int block_bits = 0;
+  int seek_bits = 0;
+  int zopfli_iterations = 0;
+  int64_t offset = -1;
+  int64_t length = -1;
   ParseArgv(argc, argv, &input_path, &output_path, &force,
-            &quality, &decompress, &repeat, &verbose);
-  const clock_t clock_start = clock();
+            &quality, &decompress, &repeat, &verbose, &threads, &block_bits,
+            &seek_bits, &zopfli_iterations, &offset, &length);
+  if ((offset >= 0) != (length >= 0) || (offset >= 0 && !decompress)) {
+    fprintf(stderr, "--offset and --length need --decompress\n");
+    exit(1);
+  }
+  if (threads > 0 && seek_bits > 0 && !decompress) {
+    // The parallel compressor does not write a seek index.
+    fprintf(stderr, "--seek-bits cannot be used with --threads\n");
+    exit(1);
+  }
+  std::vector<brotli::BrotliWorkerStats> worker_stats;
+  const std::chrono::steady_clock::time_point clock_start =
+      std::chrono::steady_clock::now();
   for (int i = 0; i < repeat; ++i) {
     FILE* fin = OpenInputFile(input_path);
     FILE* fout = OpenOutputFile(output_path, force);
-    if (decompress) {
+    if (decompress && offset >= 0) {
+      if (!DecompressRange(fin, fout, offset, length)) {
+        fprintf(stderr, "corrupt input\n");
+        exit(1);
+      }
+    } else if (decompress && threads > 0) {
+      if (!DecompressParallel(fin, fout, threads)) {
+        fprintf(stderr, "corrupt input\n");
+        exit(1);
+      }
+    } else if (decompress) {
       BrotliInput in = BrotliFileInput(fin);
       BrotliOutput out = BrotliFileOutput(fout);
       if (!BrotliDecompress(in, out)) {
@@ -193,9 +375,26 @@ int main(int argc, char** argv) {
     } else {
       brotli::BrotliParams params;
       params.quality = quality;
+      params.lgblock = block_bits;
+      params.lgseek = seek_bits;
+      params.zopfli_iterations = zopfli_iterations;
       brotli::BrotliFileIn in(fin, 1 << 16);
       brotli::BrotliFileOut out(fout);
-      if (!BrotliCompress(params, &in, &out)) {
+      bool ok;
+      if (threads > 0) {
+        // The input blocks are compressed on worker threads, each of them
+        // starting from a hasher that is warmed up with the preceding window.
+        brotli::BrotliParallelParams parallel_params;
+        parallel_params.num_threads = threads;
+        parallel_params.warmup_hashers = true;
+        ok = BrotliCompressParallel(params, parallel_params, &in, &out,
+                                    &worker_stats);
+      } else if (seek_bits > 0) {
+        ok = BrotliCompressSeekable(params, &in, &out);
+      } else {
+        ok = BrotliCompress(params, &in, &out);
+      }
+      if (!ok) {
         fprintf(stderr, "compression failed\n");
         unlink(output_path);
         exit(1);
@@ -211,9 +410,8 @@ int main(int argc, char** argv) {
     }
   }
   if (verbose) {
-    const clock_t clock_end = clock();
-    double duration =
-        static_cast<double>(clock_end - clock_start) / CLOCKS_PER_SEC;
+    double duration = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - clock_start).count();
     if (duration < 1e-9) {
       duration = 1e-9;
     }
@@ -226,6 +424,13 @@ int main(int argc, char** argv) {
       printf("Brotli compression speed: ");
     }
     printf("%g MB/s\n", uncompressed_bytes_in_MB / duration);
+    for (size_t i = 0; i < worker_stats.size(); ++i) {
+      const brotli::BrotliWorkerStats& stats = worker_stats[i];
+      double seconds = stats.seconds < 1e-9 ? 1e-9 : stats.seconds;
+      printf("Thread %d: %d blocks, %g MB/s\n", static_cast<int>(i),
+             stats.num_blocks,
+             stats.input_bytes / (1024.0 * 1024.0) / seconds);
+    }
   }
   return 0;
 }